@@ -0,0 +1,2141 @@
+#define _GNU_SOURCE		// pthread_getattr_np
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "cantang.h"
+
+#define STEP_BATCH	1024	// 実行の上限はこの文数ごとに検査する
+#define STACK_RESERVE	(256 * 1024)	// 関数呼び出しの深さの上限で、エラー処理のために残すスタック
+
+typedef enum {
+	T_NULL = 0,		// トークンが使用されていない、またはトークン列の終端を表す
+	T_KEYWORD,		// キーワード(int, forなど)
+	T_INTVAL,		// 数値リテラル
+	T_IDENT,		// 変数名など
+	T_SYMBOL		// 演算子
+} tokenType;
+
+typedef struct token {
+	tokenType type;
+	char *text;		// 対応するソースコード。T_IDENT, T_SYMBOLまたはT_KEYWORDのときに使う
+	long long intval;		// 整数。T_INTVALのときに使う
+	int symbol;		// symbols[]内のインデックス。T_SYMBOLの時に使う
+	int string;		// 文字列リテラルなら 1 (T_INTVAL の intval は文字列を指す)
+	struct switch_table *table;	// switch の分岐表。最初に実行したときに作る
+	int match;		// { と対応する } までのトークン数。0 は対応する } がない
+	int materialized;		// 関数の本体の { で、最初の呼び出しで本体を読んだら 1
+} token;
+
+/* グローバル変数 */
+static const char * const keywords[] = {
+	"int", "print", "puts", "return", "if", "break", "continue", "for", "while",
+	"void", "char", "signed", "unsigned", "long", "const", "parallel", "switch", "case", "default",
+	NULL
+};
+
+static struct {
+	const char * const text;
+	int priority[3];	// PRE, POST, BINARY
+} symbols[] = {
+	{NULL, {0,0,0}}, {"++", {2, 1, 0}}, {"--", {2, 1, 0}}, {"->", {0, 0, 1}}, {".", {0, 0, 1}}, {"~", {2, 0, 0}},
+	{"!", {2, 0, 0}}, {"*", {2, 0, 4}}, {"/", {0, 0, 4}}, {"%", {0, 0, 4}}, {"+", {2, 0, 5}}, {"-", {2, 0, 5}},
+	{"<<", {0, 0, 6}}, {">>", {0, 0, 6}}, {"<", {0, 0, 7}}, {"<=", {0, 0, 7}}, {">", {0, 0, 7}}, {">=", {0, 0, 7}},
+	{"==", {0, 0, 8}}, {"!=", {0, 0, 8}}, {"&", {2, 0, 9}}, {"^", {0, 0, 10}}, {"|", { 0,  0, 11}}, {"&&", {0, 0, 12}},
+	{"||", {0, 0, 13}}, {"=", {0, 0, 15}}, {"+=", {0, 0, 15}}, {"-=", {0, 0, 15}}, {"*=", {0, 0, 15}},
+	{"/=", {0, 0, 15}}, {"%=", {0, 0, 15}}, {"<<=", {0, 0, 15}}, {">>=", {0, 0, 15}}, {"&=", {0, 0, 15}},
+	{"^=", {0, 0, 15}}, {"|=", {0, 0, 15}}, {",", {0, 0, 16}}, {"(", {0, 1, 0}}, {")", {0, 0, 0}}, {"{", {0, 0, 0}},
+	{"}", {0, 0, 0}}, {"[", {0, 1, 0}}, {"]", {0, 0, 0}}, {"?", {0, 0, 0}}, {":", {0, 0, 0}}, {";", {0, 0, 0}},
+	{NULL,  { 0,  0,  0}}
+};
+
+typedef struct map {
+	struct map *next;
+	char *key;
+	void *value;
+} map;
+
+typedef struct {
+	enum {
+		VT_NULL = 0, VT_INT, VT_FUNC, VT_ARRAY, VT_STRUCT, VT_NATIVE
+	} type;
+	long long intval;
+	map *table;		// for struct
+} variable;
+
+typedef struct block {
+	struct block *parent;
+	map *table;
+} block;
+
+/* インタープリタが確保したメモリ。確保した場所ごとのリストにつながれる */
+typedef struct memnode {
+	struct memnode *prev, *next;
+	size_t size;
+	short kind;
+	short counted;	// 0: 数えていない, 1: budget->mem に数えた, 2: memstat にも数えた
+	int site;
+} memnode;
+
+#define MEM_PERM    0	// トークンや文字列リテラル。cantang_destroy で解放する
+#define MEM_TEMP    1	// 式の一時領域。文の終わりで解放する
+#define MEM_LOCAL   2	// 変数や配列、引数。宣言したブロックを抜けるときに解放する
+#define MEM_HEAP    3	// スクリプトの malloc。free で解放する
+
+/* malloc で確保した領域。parallel for のワーカーと共有するためロックを持つ */
+typedef struct memheap {
+	pthread_mutex_t lock;
+	memnode *list;
+	memnode **set;		// free で正しいポインタか調べるための、アドレスをキーとするハッシュ表
+	size_t cap;			// set の大きさ (2 の累乗)
+	size_t used;		// 使用中と削除済みの数
+	size_t count;		// 使用中の数
+} memheap;
+
+#define HEAP_DELETED	((memnode *) 1)		// set の削除済みの印
+
+/* メモリを確保した場所 (--mem-stats で集計する) */
+enum {
+	SITE_TOKEN = 0,	// トークン列
+	SITE_TEXT,		// トークンの文字列
+	SITE_STRING,	// 文字列リテラル
+	SITE_TEMP,		// 式の値
+	SITE_ADDR,		// & の結果
+	SITE_ARGS,		// 関数の引数
+	SITE_MAP,		// 名前表 (map) のノード
+	SITE_VAR,		// 変数、関数
+	SITE_ARRAY,		// 配列
+	SITE_STRUCT,	// 構造体
+	SITE_HEAP,		// malloc
+	SITE_OTHER,		// parallel for のワーカーなど
+	SITE_MAX
+};
+
+static const char * const site_names[] = {
+	"token", "text", "string", "temp", "addr", "args", "map", "variable", "array", "struct",
+	"heap", "other"
+};
+
+/* 確保した場所ごとの集計。カウンタはアトミックに更新する */
+typedef struct memstat {
+	long long count[SITE_MAX], bytes[SITE_MAX], live[SITE_MAX];
+	long long peak;
+	pthread_mutex_t lock;	// samples への書き込み
+	FILE *samples;			// 定期的な記録の出力先
+	double interval, start, next;
+} memstat;
+
+/* 実行の上限。parallel for のワーカーと共有するため、カウンタはアトミックに更新する */
+typedef struct budget {
+	long long max_steps, steps;		// 実行した文の数
+	long long max_mem, mem;			// 確保中のバイト数
+	double timeout, deadline;		// 秒。0 は無制限
+} budget;
+
+/* 関数の数。parallel for のワーカーと共有するため、アトミックに更新する */
+typedef struct funcstat {
+	long long declared;		// 本体を持つ関数の宣言
+	long long materialized;	// 呼び出されて本体を読んだ関数
+} funcstat;
+
+/* インスタンスが参照を持っているキャッシュのエントリ */
+typedef struct cache_hold {
+	struct cache_hold *next;
+	struct cache_entry *entry;
+} cache_hold;
+
+typedef struct cantang {
+	token *token;		// 現在注目しているトークン
+	token *tokens;		// トークン列の先頭
+	long long return_value;
+	block *global;
+	FILE *out;			// print, puts の出力先
+	char *include_dir;
+	memnode *mem;		// MEM_PERM
+	memnode *temps;		// MEM_TEMP
+	memnode *locals;	// MEM_LOCAL
+	memheap *heap;		// MEM_HEAP
+	budget *budget;
+	funcstat *funcs;
+	memstat *stats;		// --mem-stats が無効なら NULL
+	cantang_cache *cache;	// #include の読み込みに使うキャッシュ。なければ NULL
+	cache_hold *held;	// トークンの text がエントリを指すので、破棄するまで参照を持つ
+	long long steps;	// budget に反映していない文の数
+	uintptr_t stack_limit;	// 関数呼び出しでスタックがここより深くなったら中断する
+	int threads;		// parallel for のワーカースレッド数
+	int stage;			// err() が返すエラーコード (読み込み中か実行中か)
+	jmp_buf *jmp;		// err() の脱出先
+	char errmsg[256];
+} context;
+
+static void raise_error(context *ctx, int code, const char *fmt, ...) __attribute__((noreturn));
+static void raise_error(context *ctx, int code, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(ctx->errmsg, sizeof(ctx->errmsg), fmt, ap);
+	va_end(ap);
+	longjmp(*ctx->jmp, code);
+}
+
+#define err(ctx, ...)	raise_error(ctx, (ctx)->stage, __VA_ARGS__)
+
+/* 現在のスレッドのスタックから、関数呼び出しで使ってよい下限を決めます */
+static void stack_init(context *ctx) {
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+	char here;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+			ctx->stack_limit = (uintptr_t) addr + (size / 4 < STACK_RESERVE ? size / 4 : STACK_RESERVE);
+			pthread_attr_destroy(&attr);
+			return;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	ctx->stack_limit = (uintptr_t) &here - 1024 * 1024;	// 分からなければ 1MB まで
+}
+
+/* 再帰が深すぎるとスタックがあふれてプロセスごと落ちるので、その前に中断する */
+static void check_stack(context *ctx) {
+	char here;
+	if ((uintptr_t) &here < ctx->stack_limit)
+		raise_error(ctx, CANTANG_ERR_DEPTH, "Call depth limit exceeded");
+}
+
+static void mem_link(memnode **list, memnode *n) {
+	n->prev = NULL;
+	n->next = *list;
+	if (*list != NULL) (*list)->prev = n;
+	*list = n;
+}
+
+static void mem_unlink(memnode **list, memnode *n) {
+	if (n->prev != NULL) n->prev->next = n->next;
+	else *list = n->next;
+	if (n->next != NULL) n->next->prev = n->prev;
+}
+
+static void stat_alloc(memstat *st, int site, long long bytes, long long used) {
+	long long peak = __atomic_load_n(&st->peak, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->count[site], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->bytes[site], bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->live[site], bytes, __ATOMIC_RELAXED);
+	while (used > peak && !__atomic_compare_exchange_n(&st->peak, &peak, used, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static memnode *mem_new(context *ctx, int kind, int site, size_t count, size_t size) {
+	budget *b = ctx->budget;
+	long long bytes = sizeof(memnode) + count * size, used = 0;
+	/* 上限も統計もなければ、スレッド間で共有するカウンタには触らない */
+	int counted = ctx->stats != NULL ? 2 : b->max_mem > 0;
+	if (counted && (used = __atomic_add_fetch(&b->mem, bytes, __ATOMIC_RELAXED)) > b->max_mem && b->max_mem > 0) {
+		__atomic_sub_fetch(&b->mem, bytes, __ATOMIC_RELAXED);
+		raise_error(ctx, CANTANG_ERR_MEMLIMIT, "Memory limit exceeded (%lld bytes)", b->max_mem);
+	}
+	memnode *n = calloc(1, bytes);
+	if (n == NULL) {
+		if (counted) __atomic_sub_fetch(&b->mem, bytes, __ATOMIC_RELAXED);
+		raise_error(ctx, CANTANG_ERR_NOMEM, "Out of memory");
+	}
+	n->size = count * size;
+	n->kind = kind;
+	n->counted = counted;
+	n->site = site;
+	if (counted == 2) stat_alloc(ctx->stats, site, bytes, used);
+	return n;
+}
+
+static void mem_free(context *ctx, memnode *n) {
+	long long bytes = sizeof(memnode) + n->size;
+	if (n->counted) __atomic_sub_fetch(&ctx->budget->mem, bytes, __ATOMIC_RELAXED);
+	if (n->counted == 2) __atomic_sub_fetch(&ctx->stats->live[n->site], bytes, __ATOMIC_RELAXED);
+	free(n);
+}
+
+/* mark より後に確保したものを解放します (スタックのように使う) */
+static void mem_release(context *ctx, memnode **list, memnode *mark) {
+	while (*list != mark) {
+		memnode *n = *list;
+		*list = n->next;
+		mem_free(ctx, n);
+	}
+	if (*list != NULL) (*list)->prev = NULL;
+}
+
+static void *ct_calloc(context *ctx, int site, size_t count, size_t size) {
+	memnode *n = mem_new(ctx, MEM_PERM, site, count, size);
+	mem_link(&ctx->mem, n);
+	return n + 1;
+}
+
+static void *ct_temp(context *ctx, int site, size_t count, size_t size) {
+	memnode *n = mem_new(ctx, MEM_TEMP, site, count, size);
+	mem_link(&ctx->temps, n);
+	return n + 1;
+}
+
+static void *ct_local(context *ctx, int site, size_t count, size_t size) {
+	memnode *n = mem_new(ctx, MEM_LOCAL, site, count, size);
+	mem_link(&ctx->locals, n);
+	return n + 1;
+}
+
+static char *ct_strdup(context *ctx, const char *s) {
+	return strcpy(ct_calloc(ctx, SITE_TEXT, strlen(s) + 1, 1), s);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 経過時間, 文の数, 確保中のバイト数, 最大値, 場所ごとの確保中のバイト数 を1行記録します */
+static void mem_sample(context *ctx, double t) {
+	memstat *st = ctx->stats;
+	int i;
+	pthread_mutex_lock(&st->lock);
+	fprintf(st->samples, "%.6f,%lld,%lld,%lld", t - st->start,
+			__atomic_load_n(&ctx->budget->steps, __ATOMIC_RELAXED),
+			__atomic_load_n(&ctx->budget->mem, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->peak, __ATOMIC_RELAXED));
+	for (i = 0; i < SITE_MAX; i++) fprintf(st->samples, ",%lld", __atomic_load_n(&st->live[i], __ATOMIC_RELAXED));
+	fputc('\n', st->samples);
+	t += st->interval;
+	__atomic_store(&st->next, &t, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* STEP_BATCH 文ごとに呼ばれ、文の数と経過時間を検査します */
+static void check_budget(context *ctx) {
+	budget *b = ctx->budget;
+	memstat *st = ctx->stats;
+	long long steps = __atomic_add_fetch(&b->steps, ctx->steps, __ATOMIC_RELAXED);
+	double t = 0;
+	ctx->steps = 0;
+	if (b->max_steps > 0 && steps > b->max_steps)
+		raise_error(ctx, CANTANG_ERR_STEPS, "Step limit exceeded (%lld statements)", b->max_steps);
+	if (b->deadline > 0 && (t = now()) > b->deadline)
+		raise_error(ctx, CANTANG_ERR_TIMEOUT, "Timeout (%g seconds)", b->timeout);
+	if (st != NULL && st->samples != NULL) {
+		double next;
+		__atomic_load(&st->next, &next, __ATOMIC_RELAXED);
+		if (t == 0) t = now();
+		if (t >= next) mem_sample(ctx, t);
+	}
+}
+
+static int cmp(context *ctx, const char *s) {
+	return ctx->token->type != T_NULL && ctx->token->type != T_INTVAL && strcmp(ctx->token->text, s) == 0;
+}
+
+static int cmp_skip(context *ctx, const char *s) {
+	int ret = cmp(ctx, s);
+	if (ret) ctx->token++;
+	return ret;
+}
+
+static void cmp_err_skip(context *ctx, const char *s) {
+	int ret = cmp_skip(ctx, s);
+	if (!ret) err(ctx, "require %s", s);
+}
+
+static map *map_add(context *ctx, map *m, char *key, void *value) {
+	map *n = ct_local(ctx, SITE_MAP, 1, sizeof(map));
+	n->next = m;
+	n->key = key;
+	n->value = value;
+	return n;
+}
+
+static int map_count(map *m) {
+	if (m == NULL) return 0;
+	return 1 + map_count(m->next);
+}
+
+static void *map_search(map *m, const char *key) {
+	while (m != NULL) {
+		if (strcmp(m->key, key) == 0) return m->value;
+		m = m->next;
+	}
+	return NULL;
+}
+
+static variable *search(block *blk, const char *key) {
+	while (blk != NULL) {
+		variable *b = (variable *) map_search(blk->table, key);
+		if (b != NULL) return b;
+		blk = blk->parent;
+	}
+	return NULL;
+}
+
+static void getbase_and_concat(const char *base, const char *rel1, const char *rel2, char *ret) {
+	const char *e = strrchr(base, '/');
+	if (e != NULL) {
+		while (base < e) *ret++ = *base++;
+		*ret++ = '/';
+	}
+	while (*rel1 != '\0') *ret++ = *rel1++;
+	if (rel2 != NULL) {
+		*ret++ = '/';
+		while (*rel2 != '\0') *ret++ = *rel2++;
+	}
+	*ret = '\0';
+}
+
+static int proceed_binary_operator(context *ctx, token *op, int a, int b) {
+	/* 0 での除算や INT_MIN / -1 は SIGFPE でプロセスごと落ちるので、エラーにする */
+	if (strcmp(op->text, "/") == 0 || strcmp(op->text, "%") == 0) {
+		if (b == 0) err(ctx, "Division by zero");
+		if (a == INT_MIN && b == -1) err(ctx, "Division overflow");
+	}
+	if      (strcmp(op->text, "*" ) == 0) return a *  b;
+	else if (strcmp(op->text, "/" ) == 0) return a /  b;
+	else if (strcmp(op->text, "%" ) == 0) return a %  b;
+	else if (strcmp(op->text, "+" ) == 0) return a +  b;
+	else if (strcmp(op->text, "-" ) == 0) return a -  b;
+	else if (strcmp(op->text, "<<") == 0) return a << b;
+	else if (strcmp(op->text, ">>") == 0) return a >> b;
+	else if (strcmp(op->text, "<" ) == 0) return a <  b;
+	else if (strcmp(op->text, "<=") == 0) return a <= b;
+	else if (strcmp(op->text, ">" ) == 0) return a >  b;
+	else if (strcmp(op->text, ">=") == 0) return a >= b;
+	else if (strcmp(op->text, "==") == 0) return a == b;
+	else if (strcmp(op->text, "!=") == 0) return a != b;
+	else if (strcmp(op->text, "&" ) == 0) return a &  b;
+	else if (strcmp(op->text, "^" ) == 0) return a ^  b;
+	else if (strcmp(op->text, "|" ) == 0) return a |  b;
+	else if (strcmp(op->text, "&&") == 0) return a && b;
+	else if (strcmp(op->text, "||") == 0) return a || b;
+	else if (strcmp(op->text, "," ) == 0) return b;
+	else err(ctx, "Not implemented: %s", op->text);
+}
+
+static int type_cmp_skip(context *ctx) {
+	int ret = 0;
+	while (1) {
+		if (cmp_skip(ctx, "int") || cmp_skip(ctx, "void") || cmp_skip(ctx, "char")
+			|| cmp_skip(ctx, "signed") || cmp_skip(ctx, "unsigned") || cmp_skip(ctx, "long")
+			|| cmp_skip(ctx, "const") || cmp_skip(ctx, "*")) ret++;
+		else if (cmp_skip(ctx, "struct")) ctx->token++, ret++;
+		else break;
+	}
+	return ret;
+}
+
+typedef long long (*native_func)(context *, variable **, int);
+
+static int proceed_statement(context *, block *, int);
+static variable *proceed_expression(context *, block *, int, int);
+
+/* 関数の本体は宣言のときには読み飛ばすだけなので、最初の呼び出しで一度だけ構文を検査します */
+static void materialize(context *ctx, block *blk) {
+	token *body = ctx->token;
+	int expected = 0;
+	proceed_statement(ctx, blk, 0);
+	ctx->token = body;
+	if (__atomic_compare_exchange_n(&body->materialized, &expected, 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&ctx->funcs->materialized, 1, __ATOMIC_RELAXED);
+}
+static variable *proceed_expression_internal(context *ctx, block *blk, int isVector, int priority, int ef) {
+	variable *retvar = NULL;
+	long long ret = 0, i = 0;
+	token *op;
+	if (priority == 0) {
+		if (ctx->token->type == T_INTVAL) {
+			if (ef) ret = ctx->token->intval;
+			ctx->token++;
+			retvar = NULL;
+		} else if (cmp_skip(ctx, "(")) {
+			retvar = proceed_expression(ctx, blk, 0, ef);
+			cmp_err_skip(ctx, ")");
+		} else {
+			if (ef) {
+				retvar = search(blk, ctx->token->text);
+				if (retvar == NULL) err(ctx, "Invalid terminal term: %s", ctx->token->text);
+			}
+			ctx->token++;
+		}
+	} else if (symbols[ctx->token->symbol].priority[0] == priority) {
+		op = ctx->token++;
+		retvar = proceed_expression_internal(ctx, blk, isVector, priority, ef);
+		if (ef) ret = retvar->intval;
+		if (strcmp(op->text, "*") == 0) retvar = (variable *) ret; 
+		else if (strcmp(op->text, "&") == 0) {
+			variable *var = ct_temp(ctx, SITE_ADDR, 1, sizeof(variable));
+			var->type = VT_INT;
+			var->intval = (long long) retvar;
+			retvar = var;
+		} else {
+			if      (strcmp(op->text, "+") == 0) ret = +ret;
+			else if (strcmp(op->text, "-") == 0) ret = -ret;
+			else if (strcmp(op->text, "!") == 0) ret = !ret;
+			else if (strcmp(op->text, "~") == 0) ret = ~ret;
+			else if ((i = (strcmp(op->text, "++") == 0)) || strcmp(op->text, "--") == 0) {
+				if (ef) ret = i ? ++retvar->intval : --retvar->intval;
+			} else err(ctx, "Not implemented: %s", ctx->token->text);
+			retvar = NULL;	// You have to duplicate variable
+		}
+	} else {
+		retvar = proceed_expression_internal(ctx, blk, isVector, priority - 1, ef);
+		if (ef) ret = retvar->intval;
+		if (symbols[ctx->token->symbol].priority[2] == priority && !(isVector && cmp(ctx, ","))) {
+			if (priority == 14 || priority == 15) {
+				op = ctx->token++;
+				variable *right = proceed_expression_internal(ctx, blk, isVector, priority, ef);
+				if (ef) {
+					if (strcmp(op->text, "=") == 0) ret = retvar->intval = right->intval;
+					else ret = proceed_binary_operator(ctx, op, ret, right->intval);
+				}
+				retvar = NULL;
+			} else if ((i = cmp_skip(ctx, "->")) || cmp_skip(ctx, ".")) {
+				if (ef) {
+					if (i) retvar = (variable *)retvar->intval;
+					map *m = retvar->table;
+					for (i = 0; m != NULL; m = m->next, i++)
+						if (strcmp(m->key, ctx->token->text) == 0) break;
+					if (m == NULL) err(ctx, "Invalid member: %s", ctx->token->text);
+					retvar += i;
+				}
+				ctx->token++;
+			} else {
+				do {
+					int effective = 1;
+					if (cmp(ctx, "&&")) effective = ret;
+					else if (cmp(ctx, "||")) effective = !ret;
+					op = ctx->token++;
+					variable *right = proceed_expression_internal(ctx, blk, isVector, priority - 1, ef && effective);
+					if (ef && effective) ret = proceed_binary_operator(ctx, op, ret, right->intval);
+				} while (symbols[ctx->token->symbol].priority[2] == priority);
+				retvar = NULL;
+			}
+		} else if (priority == 14 && cmp_skip(ctx, "?")) {
+			variable *a = proceed_expression_internal(ctx, blk, isVector, priority, ef);
+			cmp_err_skip(ctx, ":");
+			variable *b = proceed_expression_internal(ctx, blk, isVector, priority, ef);
+			if (ef) ret = ret ? a->intval : b->intval;
+			retvar = NULL;
+		} else {
+			while (symbols[ctx->token->symbol].priority[1] == priority) {
+				if ((i = (cmp_skip(ctx, "++"))) || cmp_skip(ctx, "--")) {
+					if (ef) ret = i ? retvar->intval++ : retvar->intval--;
+					retvar = NULL;
+				} else if (cmp_skip(ctx, "(")) {
+					variable *args_val[16];
+					int args_count = 0;
+					memnode *mark = ctx->locals;	// 引数は関数から戻るときに解放する
+					if (!cmp(ctx, ")")) {
+						do {
+							variable *var = proceed_expression(ctx, blk, 1, ef);
+							if (ef) {
+								int size = var->table != NULL ? map_count(var->table) : 1;
+								variable *var2 = ct_local(ctx, SITE_ARGS, size, sizeof(variable));
+								memcpy(var2, var, size * sizeof(variable));
+								args_val[args_count++] = var2;
+							}
+						} while (cmp_skip(ctx, ","));
+					}
+					cmp_err_skip(ctx, ")");
+					if (ef && retvar != NULL && retvar->type == VT_NATIVE) {
+						ret = ((native_func) retvar->intval)(ctx, args_val, args_count);
+						retvar = NULL;
+						mem_release(ctx, &ctx->locals, mark);
+					} else if (ef) {
+						block args = {ctx->global, NULL};
+						token *tk = ctx->token;
+						check_stack(ctx);
+						ctx->token = (token *) ret;
+						i = 0;
+						do {
+							type_cmp_skip(ctx);
+							if (ctx->token->type == T_IDENT) {
+								args.table = map_add(ctx, args.table, ctx->token->text, args_val[i]);
+								ctx->token++;
+							}
+							i++;
+						} while (cmp_skip(ctx, ","));
+						cmp_err_skip(ctx, ")");
+						if (!__atomic_load_n(&ctx->token->materialized, __ATOMIC_ACQUIRE)) materialize(ctx, &args);
+						proceed_statement(ctx, &args, 1);
+						ret = ctx->return_value;
+						retvar = NULL;
+						ctx->token = tk;
+						mem_release(ctx, &ctx->locals, mark);
+					}
+				} else if (cmp_skip(ctx, "[")) {
+					variable *var = proceed_expression(ctx, blk, 0, ef);
+					if (ef) {
+						retvar = (variable *)(ret + sizeof(variable) * var->intval);
+						ret = retvar->intval;
+					}
+					cmp_err_skip(ctx, "]");
+				} else err(ctx, "Not implemented: %s", ctx->token->text);
+			}
+		}
+	}
+	if (ef && retvar == NULL) {
+		retvar = (variable *) ct_temp(ctx, SITE_TEMP, 1, sizeof(variable));
+		retvar->type = VT_INT;
+		retvar->intval = ret;
+	}
+	return retvar;
+}
+
+static variable *proceed_expression(context *ctx, block *blk, int isVector, int ef) {
+	return proceed_expression_internal(ctx, blk, isVector, 16, ef);
+}
+
+#define RTYPE_NORMAL    0
+#define RTYPE_RETURN    1
+#define RTYPE_BREAK     2
+#define RTYPE_CONTINUE  3
+
+static variable *allocate_array_mem(context *ctx, variable *arrlens[], int max, int index) {
+	variable *var, *var2;
+	int len = arrlens[index]->intval, i;
+	if (index == max - 1) {
+		var = ct_local(ctx, SITE_ARRAY, len, sizeof(variable));
+		var->type = VT_ARRAY;
+	} else {
+		var = ct_local(ctx, SITE_ARRAY, len, sizeof(variable));
+		for (i = 0; i < len; i++) {
+			var2 = allocate_array_mem(ctx, arrlens, max, index + 1);
+			var[i].intval = (long long) var2;
+			var[i].type = VT_ARRAY;
+		}
+	}
+	return var;
+}
+
+/* parallel for のワーカー1つ分の状態 */
+typedef struct {
+	context ctx;			// ワーカー専用のコンテキスト (確保したメモリもワーカーに属する)
+	block *parent;
+	token *body;
+	char *name, *rname;		// ループ変数, reduction の変数
+	const char *rop;		// reduction の演算子
+	long long start, step, from, to;	// [from, to) 回目の繰り返しを担当する
+	long long partial;		// reduction の部分結果
+	int code;
+	pthread_t thread;
+} parallel_worker;
+
+static long long reduction_identity(const char *op) {
+	if (strcmp(op, "*") == 0) return 1;
+	if (strcmp(op, "&") == 0) return ~0LL;
+	if (strcmp(op, "min") == 0) return INT_MAX;	// 二項演算子は int で計算されるため
+	if (strcmp(op, "max") == 0) return INT_MIN;
+	return 0;	// +, |, ^
+}
+
+/* 二項演算子と同じく int で計算する。あふれても逐次実行と同じ値になり、スレッド数によらない */
+static long long reduction_apply(const char *op, long long a, long long b) {
+	unsigned int x = a, y = b;
+	if (strcmp(op, "*") == 0) return (int) (x * y);
+	if (strcmp(op, "&") == 0) return (int) (x & y);
+	if (strcmp(op, "|") == 0) return (int) (x | y);
+	if (strcmp(op, "^") == 0) return (int) (x ^ y);
+	if (strcmp(op, "min") == 0) return (int) a < (int) b ? (int) a : (int) b;
+	if (strcmp(op, "max") == 0) return (int) a > (int) b ? (int) a : (int) b;
+	return (int) (x + y);
+}
+
+static void *parallel_worker_main(void *arg) {
+	parallel_worker *w = arg;
+	context *ctx = &w->ctx;
+	jmp_buf jmp;
+	long long k;
+	block blk = {w->parent, NULL};
+	variable *iv, *rv = NULL;
+	stack_init(ctx);	// ワーカーは自分のスレッドのスタックで動く
+	ctx->jmp = &jmp;
+	if ((w->code = setjmp(jmp)) != 0) {
+		mem_release(ctx, &ctx->temps, NULL);
+		mem_release(ctx, &ctx->locals, NULL);
+		return NULL;
+	}
+	iv = ct_local(ctx, SITE_VAR, 1, sizeof(variable));
+	iv->type = VT_INT;
+	blk.table = map_add(ctx, blk.table, w->name, iv);
+	if (w->rname != NULL) {
+		rv = ct_local(ctx, SITE_VAR, 1, sizeof(variable));
+		rv->type = VT_INT;
+		rv->intval = reduction_identity(w->rop);
+		blk.table = map_add(ctx, blk.table, w->rname, rv);
+	}
+	for (k = w->from; k < w->to; k++) {
+		iv->intval = w->start + k * w->step;
+		ctx->token = w->body;
+		int ret = proceed_statement(ctx, &blk, 1);
+		if (ret == RTYPE_RETURN || ret == RTYPE_BREAK)
+			err(ctx, "return and break are not allowed in parallel for");
+	}
+	if (rv != NULL) w->partial = rv->intval;
+	mem_release(ctx, &ctx->locals, NULL);
+	return NULL;
+}
+
+/* parallel [reduction(op: var)] for (i = a; i < b; i++) 文
+ * 繰り返しの範囲を分割し、ワーカースレッドで並行に実行します */
+static int proceed_parallel_for(context *ctx, block *parent, int ef) {
+	char *name, *rname = NULL;
+	const char *rop = NULL, *cond;
+	long long start = 0, end = 0, step = 1, n = 0, k;
+	variable *var;
+	int i, count;
+	if (cmp(ctx, "for") && !(ctx->token[1].type == T_SYMBOL && strcmp(ctx->token[1].text, "(") == 0))
+		ctx->token++;	// #pragma parallel for
+	if (cmp_skip(ctx, "reduction")) {
+		cmp_err_skip(ctx, "(");
+		rop = ctx->token->text;
+		if (rop == NULL || !(cmp(ctx, "+") || cmp(ctx, "*") || cmp(ctx, "&") || cmp(ctx, "|")
+					|| cmp(ctx, "^") || cmp(ctx, "min") || cmp(ctx, "max")))
+			err(ctx, "Invalid reduction operator");
+		ctx->token++;
+		cmp_err_skip(ctx, ":");
+		if (ctx->token->type != T_IDENT) err(ctx, "Invalid reduction variable");
+		rname = (ctx->token++)->text;
+		cmp_err_skip(ctx, ")");
+	}
+	cmp_err_skip(ctx, "for");
+	cmp_err_skip(ctx, "(");
+	if (ctx->token->type != T_IDENT) err(ctx, "parallel for requires i = start");
+	name = (ctx->token++)->text;
+	cmp_err_skip(ctx, "=");
+	var = proceed_expression(ctx, parent, 0, ef);
+	if (ef) start = var->intval;
+	cmp_err_skip(ctx, ";");
+	if (!cmp_skip(ctx, name)) err(ctx, "parallel for requires i < end");
+	cond = ctx->token->text;
+	if (!(cmp_skip(ctx, "<") || cmp_skip(ctx, "<=") || cmp_skip(ctx, ">") || cmp_skip(ctx, ">=")
+				|| cmp_skip(ctx, "!=")))
+		err(ctx, "parallel for requires i < end");
+	var = proceed_expression(ctx, parent, 0, ef);
+	if (ef) end = var->intval;
+	cmp_err_skip(ctx, ";");
+	if (cmp_skip(ctx, "++") || cmp_skip(ctx, "--")) {
+		step = strcmp(ctx->token[-1].text, "++") == 0 ? 1 : -1;
+		if (!cmp_skip(ctx, name)) err(ctx, "parallel for requires i++");
+	} else {
+		if (!cmp_skip(ctx, name)) err(ctx, "parallel for requires i++");
+		if ((i = cmp_skip(ctx, "++")) || cmp_skip(ctx, "--")) step = i ? 1 : -1;
+		else if ((i = cmp_skip(ctx, "+=")) || cmp_skip(ctx, "-=")) {
+			var = proceed_expression(ctx, parent, 0, ef);
+			if (ef) step = i ? var->intval : -var->intval;
+		} else err(ctx, "parallel for requires i++");
+	}
+	cmp_err_skip(ctx, ")");
+	token *body = ctx->token;
+	proceed_statement(ctx, parent, 0);
+	if (!ef) return RTYPE_NORMAL;
+	token *end_token = ctx->token;
+
+	if (step == 0) err(ctx, "parallel for step is 0");
+	if (strcmp(cond, "<=") == 0) end++;
+	else if (strcmp(cond, ">=") == 0) end--;
+	if (step > 0 && end > start) n = (end - start + step - 1) / step;
+	else if (step < 0 && end < start) n = (start - end - step - 1) / -step;
+	if ((var = search(parent, name)) == NULL) err(ctx, "Invalid terminal term: %s", name);
+	variable *rvar = NULL;
+	if (rname != NULL && (rvar = search(parent, rname)) == NULL)
+		err(ctx, "Invalid terminal term: %s", rname);
+
+	count = ctx->threads < 1 ? 1 : ctx->threads;
+	if (count > n) count = n > 0 ? n : 1;
+	parallel_worker *w = ct_temp(ctx, SITE_OTHER, count, sizeof(parallel_worker));
+	for (i = 0; i < count; i++) {
+		w[i].ctx = *ctx;
+		w[i].ctx.mem = w[i].ctx.temps = w[i].ctx.locals = NULL;
+		w[i].ctx.steps = 0;
+		w[i].ctx.threads = 1;	// 入れ子の parallel for は逐次実行する
+		w[i].parent = parent;
+		w[i].body = body;
+		w[i].name = name;
+		w[i].rname = rname;
+		w[i].rop = rop;
+		w[i].start = start;
+		w[i].step = step;
+		w[i].from = n * i / count;
+		w[i].to = n * (i + 1) / count;
+	}
+	/* 最初の範囲は呼び出したスレッドで実行する */
+	for (i = 1; i < count; i++) {
+		if (pthread_create(&w[i].thread, NULL, parallel_worker_main, &w[i]) != 0) {
+			w[i].thread = pthread_self();
+			parallel_worker_main(&w[i]);
+		}
+	}
+	parallel_worker_main(&w[0]);
+	for (i = 1; i < count; i++)
+		if (!pthread_equal(w[i].thread, pthread_self())) pthread_join(w[i].thread, NULL);
+
+	/* ワーカーが確保したメモリを引き取り、部分結果を順番に結合する */
+	for (i = 0; i < count; i++) {
+		memnode *m = w[i].ctx.mem;
+		while (m != NULL) {
+			memnode *next = m->next;
+			mem_link(&ctx->mem, m);
+			m = next;
+		}
+	}
+	for (i = 0; i < count; i++)
+		if (w[i].code != 0) raise_error(ctx, w[i].code, "%s", w[i].ctx.errmsg);
+	if (rvar != NULL) {
+		for (k = rvar->intval, i = 0; i < count; i++) k = reduction_apply(rop, k, w[i].partial);
+		rvar->intval = k;
+	}
+	var->intval = start + n * step;
+	ctx->token = end_token;
+	return RTYPE_NORMAL;
+}
+
+/* switch の分岐表。case の値が密なら配列で、疎ならハッシュ表で飛び先を引く */
+typedef struct switch_table {
+	int dense;
+	long long min;		// 密な表の最小値
+	long long size;		// 密な表は最大値 - 最小値 + 1、ハッシュ表は 2 の累乗
+	long long *keys;	// ハッシュ表のキー
+	token **jump;		// case の次のトークン。NULL は空き
+	token *def;			// default: の次のトークン。なければ NULL
+	token *end;			// } の次のトークン
+} switch_table;
+
+typedef struct {
+	long long key;
+	token *target;
+} switch_case;
+
+static long long switch_hash(long long key, long long size) {
+	return ((unsigned long long) key * 0x9E3779B97F4A7C15ULL >> 32) & (size - 1);
+}
+
+static token *switch_lookup(switch_table *t, long long key) {
+	long long k;
+	if (t->dense) {
+		unsigned long long d = (unsigned long long) key - (unsigned long long) t->min;
+		if (d < (unsigned long long) t->size && t->jump[d] != NULL) return t->jump[d];
+		return t->def;
+	}
+	for (k = switch_hash(key, t->size); t->jump[k] != NULL; k = (k + 1) & (t->size - 1))
+		if (t->keys[k] == key) return t->jump[k];
+	return t->def;
+}
+
+/* { の次から } の次まで読み進め、case の値を集めて分岐表を作ります。ef が 0 なら読み飛ばすだけ。
+ * case は switch の本体の直下に書いたものだけを数える */
+static switch_table *build_switch(context *ctx, block *parent, int ef) {
+	switch_case *cases = NULL;
+	long long n = 0, cap = 0, min = 0, max = 0, i, k;
+	token *def = NULL;
+	while (!cmp_skip(ctx, "}")) {
+		if (cmp_skip(ctx, "case")) {
+			/* 値は最初の実行で表に入れたまま使うので、整数か文字のリテラル (と単項の -) に限る */
+			int neg = cmp_skip(ctx, "-");
+			if (ctx->token->type != T_INTVAL || ctx->token->string) err(ctx, "case label is not constant");
+			long long key = neg ? -ctx->token->intval : ctx->token->intval;
+			ctx->token++;
+			cmp_err_skip(ctx, ":");
+			if (!ef) continue;
+			if (n == cap) {
+				switch_case *c = ct_temp(ctx, SITE_OTHER, cap = cap ? cap * 2 : 16, sizeof(switch_case));
+				if (n > 0) memcpy(c, cases, n * sizeof(switch_case));
+				cases = c;
+			}
+			cases[n].key = key;
+			cases[n++].target = ctx->token;
+		} else if (cmp_skip(ctx, "default")) {
+			cmp_err_skip(ctx, ":");
+			if (ef && def != NULL) err(ctx, "Duplicate default");
+			def = ctx->token;
+		} else proceed_statement(ctx, parent, 0);
+	}
+	if (!ef) return NULL;
+
+	switch_table *t = ct_calloc(ctx, SITE_OTHER, 1, sizeof(switch_table));
+	t->def = def;
+	t->end = ctx->token;
+	for (i = 0; i < n; i++) {
+		if (i == 0 || cases[i].key < min) min = cases[i].key;
+		if (i == 0 || cases[i].key > max) max = cases[i].key;
+	}
+	/* 半分以上が埋まるなら密な表にする */
+	if (n == 0 || (unsigned long long) max - (unsigned long long) min < (unsigned long long) n * 2) {
+		t->dense = 1;
+		t->min = min;
+		t->size = n > 0 ? max - min + 1 : 0;
+		t->jump = ct_calloc(ctx, SITE_OTHER, t->size, sizeof(token *));
+		for (i = 0; i < n; i++) {
+			k = cases[i].key - min;
+			if (t->jump[k] != NULL) err(ctx, "Duplicate case value: %lld", cases[i].key);
+			t->jump[k] = cases[i].target;
+		}
+	} else {
+		for (t->size = 2; t->size < n * 2; t->size *= 2);
+		t->keys = ct_calloc(ctx, SITE_OTHER, t->size, sizeof(long long));
+		t->jump = ct_calloc(ctx, SITE_OTHER, t->size, sizeof(token *));
+		for (i = 0; i < n; i++) {
+			for (k = switch_hash(cases[i].key, t->size); t->jump[k] != NULL; k = (k + 1) & (t->size - 1))
+				if (t->keys[k] == cases[i].key) err(ctx, "Duplicate case value: %lld", cases[i].key);
+			t->keys[k] = cases[i].key;
+			t->jump[k] = cases[i].target;
+		}
+	}
+	return t;
+}
+
+/* switch (式) { case 値: 文... default: 文... }
+ * 分岐表で飛び先を決め、そこから break などで抜けるまで順に実行します (fall through) */
+static int proceed_switch(context *ctx, block *parent, int ef) {
+	token *kw = ctx->token - 1;
+	switch_table *t = __atomic_load_n(&kw->table, __ATOMIC_ACQUIRE);
+	int ret = RTYPE_NORMAL;
+	cmp_err_skip(ctx, "(");
+	variable *var = proceed_expression(ctx, parent, 0, ef);
+	cmp_err_skip(ctx, ")");
+	cmp_err_skip(ctx, "{");
+	if (t == NULL) {
+		token *body = ctx->token;
+		switch_table *built = build_switch(ctx, parent, ef);
+		if (!ef) return RTYPE_NORMAL;
+		/* parallel for のワーカーが同時に作った場合は先に登録されたものを使う */
+		if (__atomic_compare_exchange_n(&kw->table, &t, built, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) t = built;
+		ctx->token = body;
+	}
+	if (!ef) {
+		ctx->token = t->end;
+		return RTYPE_NORMAL;
+	}
+	if ((ctx->token = switch_lookup(t, var->intval)) != NULL) {
+		block blk = {parent, NULL};
+		memnode *locals = ctx->locals;
+		while (ret == RTYPE_NORMAL && !cmp(ctx, "}")) {
+			if (cmp_skip(ctx, "case")) {
+				proceed_expression(ctx, &blk, 0, 0);
+				cmp_err_skip(ctx, ":");
+			} else if (cmp_skip(ctx, "default")) {
+				cmp_err_skip(ctx, ":");
+			} else ret = proceed_statement(ctx, &blk, 1);
+		}
+		mem_release(ctx, &ctx->locals, locals);
+	}
+	ctx->token = t->end;
+	return ret == RTYPE_BREAK ? RTYPE_NORMAL : ret;
+}
+
+static int proceed_statement(context *ctx, block *parent, int ef) {
+	int ret = RTYPE_NORMAL, i = 0;
+	variable *var = NULL;
+	memnode *temps = ctx->temps;	// この文の一時領域は文の終わりで解放する
+	if (++ctx->steps >= STEP_BATCH) check_budget(ctx);
+	if (cmp_skip(ctx, "if")) {
+		cmp_err_skip(ctx, "(");
+		var = proceed_expression(ctx, parent, 0, ef);
+		cmp_err_skip(ctx, ")");
+		int effective = 1;
+		if (ef) effective = var->intval;
+		i = proceed_statement(ctx, parent, ef && effective);
+		if (ef && effective) ret = i;
+		if (cmp_skip(ctx, "else")) {
+			i = proceed_statement(ctx, parent, ef && !effective);
+			if (ef && !effective) ret = i;
+		}
+	} else if (cmp_skip(ctx, "for")) {
+		cmp_err_skip(ctx, "(");
+		if (!cmp(ctx, ";")) proceed_expression(ctx, parent, 0, ef);
+		cmp_err_skip(ctx, ";");
+		token *start = ctx->token, *iterate, *end;
+		do {
+			mem_release(ctx, &ctx->temps, temps);
+			if (!cmp(ctx, ";")) var = proceed_expression(ctx, parent, 0, ef);
+			cmp_err_skip(ctx, ";");
+			iterate = ctx->token;
+			proceed_expression(ctx, parent, 0, 0);
+			cmp_err_skip(ctx, ")");
+			ret = proceed_statement(ctx, parent, ef = (ef && (var == NULL ||  var->intval)));
+			end = ctx->token;
+			ctx->token = iterate;
+			if (!cmp(ctx, ")")) proceed_expression(ctx, parent, 0, ef);
+			ctx->token = start;
+		} while (ef && ret != RTYPE_RETURN && ret != RTYPE_BREAK);
+		ctx->token = end;
+		if (ret == RTYPE_BREAK) ret = RTYPE_NORMAL;
+	} else if (cmp_skip(ctx, "parallel")) {
+		ret = proceed_parallel_for(ctx, parent, ef);
+	} else if (cmp_skip(ctx, "switch")) {
+		ret = proceed_switch(ctx, parent, ef);
+	} else if (cmp_skip(ctx, "while")) {
+		cmp_err_skip(ctx, "(");
+		token *start = ctx->token;
+		do {
+			ctx->token = start;
+			mem_release(ctx, &ctx->temps, temps);
+			var = proceed_expression(ctx, parent, 0, ef);
+			cmp_err_skip(ctx, ")");
+			ret = proceed_statement(ctx, parent, ef = (ef && var->intval));
+		} while (ef && ret != RTYPE_RETURN && ret != RTYPE_BREAK);
+		if (ret == RTYPE_BREAK) ret = RTYPE_NORMAL;
+	} else if (cmp_skip(ctx, "{")) {
+		block blk = {parent, NULL};
+		memnode *locals = ctx->locals;
+		while (!cmp_skip(ctx, "}")) {
+			i = proceed_statement(ctx, &blk, ef);
+			if (ef) { ret = i; ef = !ret; }
+		}
+		mem_release(ctx, &ctx->locals, locals);
+	} else {
+		if (cmp_skip(ctx, "print")) {
+			var = proceed_expression(ctx, parent, 0, ef);
+			if (ef) fprintf(ctx->out, "%lld\n", var->intval);
+		} else if (cmp_skip(ctx, "puts")) {
+			var = proceed_expression(ctx, parent, 0, ef);
+			if (ef) {
+				for (var = (variable *)var->intval; var->intval; var++)
+					fputc(var->intval, ctx->out);
+			}
+		} else if (cmp_skip(ctx, "return")) {
+			var = proceed_expression(ctx, parent, 0, ef);
+			if (ef) ctx->return_value = var->intval;
+			ret = RTYPE_RETURN;
+		} else if ((i = cmp_skip(ctx, "break")) || cmp_skip(ctx, "continue")) {
+			ret = i ? RTYPE_BREAK : RTYPE_CONTINUE;
+		} else if (cmp_skip(ctx, "struct")) {
+			if (ctx->token->type != T_IDENT) err(ctx, "struct name is invalid");
+			if ((var = search(parent, ctx->token->text)) != NULL) {
+				ctx->token++;
+				do {
+					if (ef) {
+						variable *var2 = ct_local(ctx, SITE_STRUCT, map_count(var->table), sizeof(variable));
+						var2->table = var->table;
+						parent->table = map_add(ctx, parent->table, ctx->token->text, var2);
+					}
+					ctx->token++;
+				} while (cmp_skip(ctx, ","));
+			} else {
+				if (ef) {
+					var = ct_local(ctx, SITE_STRUCT, 1, sizeof(variable));
+					var->type = VT_STRUCT;
+					parent->table = map_add(ctx, parent->table, ctx->token->text, var);
+				}
+				ctx->token++;
+				cmp_err_skip(ctx, "{");
+				while (type_cmp_skip(ctx)) {
+					do {
+						if (ef) var->table = map_add(ctx, var->table, ctx->token->text, NULL);
+						ctx->token++;
+					} while (cmp_skip(ctx, ","));
+					cmp_err_skip(ctx, ";");
+				}
+				cmp_err_skip(ctx, "}");
+			}
+		} else if (type_cmp_skip(ctx)) {
+			do {
+				if (ef && (ctx->token->type != T_IDENT ||
+					map_search(parent->table, ctx->token->text) != NULL))
+					err(ctx, "Identifier already used: %s", ctx->token->text);
+				char *name = ctx->token->text;
+				variable *arrlens[16], *var2 = NULL;
+				ctx->token++;
+				if (cmp_skip(ctx, "(")) {
+					if (ef) {
+						var = ct_local(ctx, SITE_VAR, 1, sizeof(variable));
+						var->type = VT_FUNC;
+						var->intval = (long long) ctx->token;
+						parent->table = map_add(ctx, parent->table, name, var);
+					}
+					while (!cmp(ctx, ")") && ctx->token->type != T_NULL) ctx->token++;
+					cmp_err_skip(ctx, ")");
+					if (cmp(ctx, "{") && ctx->token->match > 0) {
+						/* 本体は対応する } まで読み飛ばし、呼び出されるまで読まない */
+						if (ef) __atomic_add_fetch(&ctx->funcs->declared, 1, __ATOMIC_RELAXED);
+						ctx->token += ctx->token->match + 1;
+					} else proceed_statement(ctx, parent, 0);
+					mem_release(ctx, &ctx->temps, temps);
+					return ret;
+				} else {
+					i = 0;
+					if (cmp_skip(ctx, "[")) {
+						do {
+							arrlens[i++] = proceed_expression(ctx, parent, 0, ef);
+							cmp_err_skip(ctx, "]");
+						} while (cmp_skip(ctx, "["));
+					}
+					if (cmp_skip(ctx, "=")) var2 = proceed_expression(ctx, parent, 1, ef);
+					if (ef) {
+						var = ct_local(ctx, SITE_VAR, 1, sizeof(variable));
+						if (i > 0) {
+							var->intval = (long long) allocate_array_mem(ctx, arrlens, i, 0);
+							var->type = VT_ARRAY;
+						} else {
+							if (var2 != NULL) var->intval = var2->intval;
+							var->type = VT_INT;
+						}
+						parent->table = map_add(ctx, parent->table, name, var);
+					}
+				}
+			} while (cmp_skip(ctx, ","));
+		} else if (cmp_skip(ctx, "do")) {
+			token *start = ctx->token;
+			do {
+				ctx->token = start;
+				mem_release(ctx, &ctx->temps, temps);
+				ret = proceed_statement(ctx, parent, ef);
+				cmp_err_skip(ctx, "while");
+				cmp_err_skip(ctx, "(");
+				var = proceed_expression(ctx, parent, 0, ef);
+			} while (ef && var->intval && ret != RTYPE_RETURN && ret != RTYPE_BREAK);
+			if (ret == RTYPE_BREAK) ret = RTYPE_NORMAL;
+			cmp_err_skip(ctx, ")");
+		} else {
+			if (!cmp(ctx, ";")) proceed_expression(ctx, parent, 0, ef);
+		}
+		cmp_err_skip(ctx, ";");
+	}
+	mem_release(ctx, &ctx->temps, temps);
+	return ret;
+}
+
+/* 文字列, 配列を走査するカーネル
+ * 要素 (variable) は 24 バイトなので、4 要素 (96 バイト) ずつ読み込み、intval だけを集めて比べる */
+#define VBLOCK			4
+#define VBLOCK_SIZE		(VBLOCK * sizeof(variable))
+
+typedef struct {
+	const char *name;
+	/* 最初に intval が a または b である要素の位置。見つかるまで読み進める */
+	long long (*find)(const variable *v, long long a, long long b);
+	/* 最初に intval が異なる要素の位置。n 要素すべて同じなら n */
+	long long (*diff)(const variable *x, const variable *y, long long n);
+	/* 最初に intval が異なるか、x の intval が 0 である要素の位置 (strcmp) */
+	long long (*compare)(const variable *x, const variable *y);
+} vkernel;
+
+/* count ブロックをまとめて読んでもページの境界をまたがないか。
+ * 文字列の終わりより先を読んでも、同じページの中なら落ちることはない */
+static int vblock_safe(const variable *v, int count) {
+	return ((uintptr_t) v & 4095) + count * VBLOCK_SIZE <= 4096;
+}
+
+static long long find_scalar(const variable *v, long long a, long long b) {
+	long long i;
+	for (i = 0; v[i].intval != a && v[i].intval != b; i++);
+	return i;
+}
+
+static long long diff_scalar(const variable *x, const variable *y, long long n) {
+	long long i;
+	for (i = 0; i < n && x[i].intval == y[i].intval; i++);
+	return i;
+}
+
+static long long compare_scalar(const variable *x, const variable *y) {
+	long long i;
+	for (i = 0; x[i].intval == y[i].intval && x[i].intval != 0; i++);
+	return i;
+}
+
+#if defined(__x86_64__)
+_Static_assert(sizeof(variable) == 24 && offsetof(variable, intval) == 8, "variable layout");
+
+/* 4 要素の intval を 1 つにまとめる。並びは [1, 0, 3, 2] */
+__attribute__((target("avx2"), no_sanitize("address", "thread")))
+static inline __m256i load_avx2(const variable *v) {
+	const __m256i *p = (const __m256i *) v;
+	__m256i x = _mm256_loadu_si256(p), y = _mm256_loadu_si256(p + 1), z = _mm256_loadu_si256(p + 2);
+	return _mm256_blend_epi32(_mm256_blend_epi32(y, x, 0x0c), z, 0x30);
+}
+
+/* [1, 0, 3, 2] の並びのビットから最初の要素の位置を求める */
+static inline int first_avx2(unsigned m) {
+	return __builtin_ctz(((m & 5) << 1) | ((m >> 1) & 5));
+}
+
+/* 8 要素 (2 ブロック) ずつ調べ、見つかったときだけ位置を求める */
+__attribute__((target("avx2"), no_sanitize("address", "thread")))
+static long long find_avx2(const variable *v, long long a, long long b) {
+	__m256i va = _mm256_set1_epi64x(a), vb = _mm256_set1_epi64x(b);
+	long long i = 0;
+	int k;
+	while (1) {
+		for (; vblock_safe(v + i, 2); i += 2 * VBLOCK) {
+			__m256i x = load_avx2(v + i), y = load_avx2(v + i + VBLOCK);
+			__m256i e = _mm256_or_si256(_mm256_cmpeq_epi64(x, va), _mm256_cmpeq_epi64(x, vb));
+			__m256i f = _mm256_or_si256(_mm256_cmpeq_epi64(y, va), _mm256_cmpeq_epi64(y, vb));
+			__m256i g = _mm256_or_si256(e, f);
+			if (_mm256_testz_si256(g, g)) continue;
+			unsigned m = _mm256_movemask_pd(_mm256_castsi256_pd(e));
+			if (m) return i + first_avx2(m);
+			return i + VBLOCK + first_avx2(_mm256_movemask_pd(_mm256_castsi256_pd(f)));
+		}
+		for (k = 0; k < VBLOCK; k++, i++)
+			if (v[i].intval == a || v[i].intval == b) return i;
+	}
+}
+
+__attribute__((target("avx2")))
+static long long diff_avx2(const variable *x, const variable *y, long long n) {
+	long long i;
+	for (i = 0; i + 2 * VBLOCK <= n; i += 2 * VBLOCK) {
+		__m256i e = _mm256_cmpeq_epi64(load_avx2(x + i), load_avx2(y + i));
+		__m256i f = _mm256_cmpeq_epi64(load_avx2(x + i + VBLOCK), load_avx2(y + i + VBLOCK));
+		unsigned m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(e, f)));
+		if (m == 15) continue;
+		m = _mm256_movemask_pd(_mm256_castsi256_pd(e));
+		if (m != 15) return i + first_avx2(~m & 15);
+		return i + VBLOCK + first_avx2(~_mm256_movemask_pd(_mm256_castsi256_pd(f)) & 15);
+	}
+	return i + diff_scalar(x + i, y + i, n - i);
+}
+
+/* find_avx2 と同じく、両方の文字列でページの境界をまたがない間だけ 8 要素ずつ調べる */
+__attribute__((target("avx2"), no_sanitize("address", "thread")))
+static long long compare_avx2(const variable *x, const variable *y) {
+	__m256i zero = _mm256_setzero_si256();
+	long long i = 0;
+	int k;
+	while (1) {
+		for (; vblock_safe(x + i, 2) && vblock_safe(y + i, 2); i += 2 * VBLOCK) {
+			__m256i a = load_avx2(x + i), b = load_avx2(x + i + VBLOCK);
+			/* 同じで、かつ 0 でない要素のビットが立つ */
+			__m256i e = _mm256_andnot_si256(_mm256_cmpeq_epi64(a, zero), _mm256_cmpeq_epi64(a, load_avx2(y + i)));
+			__m256i f = _mm256_andnot_si256(_mm256_cmpeq_epi64(b, zero),
+					_mm256_cmpeq_epi64(b, load_avx2(y + i + VBLOCK)));
+			unsigned m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(e, f)));
+			if (m == 15) continue;
+			m = _mm256_movemask_pd(_mm256_castsi256_pd(e));
+			if (m != 15) return i + first_avx2(~m & 15);
+			return i + VBLOCK + first_avx2(~_mm256_movemask_pd(_mm256_castsi256_pd(f)) & 15);
+		}
+		for (k = 0; k < VBLOCK; k++, i++)
+			if (x[i].intval != y[i].intval || x[i].intval == 0) return i;
+	}
+}
+#endif
+
+static const vkernel vkernels[] = {
+#if defined(__x86_64__)
+	{"avx2", find_avx2, diff_avx2, compare_avx2},
+#endif
+	{"scalar", find_scalar, diff_scalar, compare_scalar}
+};
+
+static const vkernel *kernel = &vkernels[sizeof(vkernels) / sizeof(vkernels[0]) - 1];
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* CPU が対応している中で最も速いカーネルを選びます。環境変数 CANTANG_SIMD で指定もできる */
+static void select_kernel(void) {
+	const char *env = getenv("CANTANG_SIMD");
+	size_t i;
+	for (i = 0; i < sizeof(vkernels) / sizeof(vkernels[0]); i++) {
+		const vkernel *k = &vkernels[i];
+#if defined(__x86_64__)
+		__builtin_cpu_init();
+		if (strcmp(k->name, "avx2") == 0 && !__builtin_cpu_supports("avx2")) continue;
+#endif
+		if (env != NULL && strcmp(env, k->name) != 0) continue;
+		kernel = k;
+		return;
+	}
+}
+
+/* 組み込み関数 */
+static variable *native_pointer(context *ctx, variable *arg, const char *name) {
+	if (arg->intval == 0) err(ctx, "%s: NULL pointer", name);
+	return (variable *) arg->intval;
+}
+
+static long long native_count(context *ctx, variable *arg, const char *name) {
+	if (arg->intval < 0) err(ctx, "%s: Invalid size: %lld", name, arg->intval);
+	return arg->intval;
+}
+
+static size_t heap_hash(memheap *h, const memnode *n) {
+	return ((uintptr_t) n >> 4) * 0x9E3779B97F4A7C15ULL >> 20 & (h->cap - 1);
+}
+
+static void heap_put(memheap *h, memnode *n) {
+	size_t k;
+	for (k = heap_hash(h, n); h->set[k] != NULL && h->set[k] != HEAP_DELETED; k = (k + 1) & (h->cap - 1));
+	if (h->set[k] == NULL) h->used++;
+	h->set[k] = n;
+}
+
+/* set に 1 つ追加できるようにします。ロックを持って呼び、失敗したら -1 を返す */
+static int heap_reserve(memheap *h) {
+	memnode **old = h->set;
+	size_t cap = h->cap, i;
+	if ((h->used + 1) * 2 <= h->cap) return 0;
+	/* 削除済みが多いだけなら同じ大きさで作り直す */
+	size_t ncap = (h->count + 1) * 4 <= cap ? cap : cap > 0 ? cap * 2 : 64;
+	memnode **set = calloc(ncap, sizeof(memnode *));
+	if (set == NULL) return -1;
+	h->set = set;
+	h->cap = ncap;
+	h->used = 0;
+	for (i = 0; i < cap; i++)
+		if (old[i] != NULL && old[i] != HEAP_DELETED) heap_put(h, old[i]);
+	free(old);
+	return 0;
+}
+
+/* p が malloc した領域の先頭なら set から取り除いてその memnode を返し、そうでなければ NULL */
+static memnode *heap_take(memheap *h, void *p) {
+	memnode *n = (memnode *) p - 1;
+	size_t k;
+	if (h->cap == 0) return NULL;
+	for (k = heap_hash(h, n); h->set[k] != NULL; k = (k + 1) & (h->cap - 1)) {
+		if (h->set[k] == n) {
+			h->set[k] = HEAP_DELETED;
+			h->count--;
+			return n;
+		}
+	}
+	return NULL;
+}
+
+/* 大きさは要素数で数える */
+static long long heap_alloc(context *ctx, long long count) {
+	memheap *h = ctx->heap;
+	memnode *n = mem_new(ctx, MEM_HEAP, SITE_HEAP, count > 0 ? count : 1, sizeof(variable));
+	pthread_mutex_lock(&h->lock);
+	if (heap_reserve(h) != 0) {
+		pthread_mutex_unlock(&h->lock);
+		mem_free(ctx, n);
+		raise_error(ctx, CANTANG_ERR_NOMEM, "Out of memory");
+	}
+	heap_put(h, n);
+	h->count++;
+	mem_link(&h->list, n);
+	pthread_mutex_unlock(&h->lock);
+	return (long long) (n + 1);
+}
+
+static long long native_malloc(context *ctx, variable **args, int argc) {
+	if (argc != 1) err(ctx, "malloc requires 1 argument");
+	return heap_alloc(ctx, native_count(ctx, args[0], "malloc"));
+}
+
+static long long native_calloc(context *ctx, variable **args, int argc) {
+	if (argc != 2) err(ctx, "calloc requires 2 arguments");
+	return heap_alloc(ctx, native_count(ctx, args[0], "calloc") * native_count(ctx, args[1], "calloc"));
+}
+
+static long long native_free(context *ctx, variable **args, int argc) {
+	if (argc != 1) err(ctx, "free requires 1 argument");
+	if (args[0]->intval == 0) return 0;
+	/* 二重の free や領域の途中を指すポインタを、読む前に弾く */
+	pthread_mutex_lock(&ctx->heap->lock);
+	memnode *n = heap_take(ctx->heap, (void *) args[0]->intval);
+	if (n != NULL) mem_unlink(&ctx->heap->list, n);
+	pthread_mutex_unlock(&ctx->heap->lock);
+	if (n == NULL) err(ctx, "Invalid free: %p", (void *) args[0]->intval);
+	mem_free(ctx, n);
+	return 0;
+}
+
+static long long native_strlen(context *ctx, variable **args, int argc) {
+	if (argc != 1) err(ctx, "strlen requires 1 argument");
+	return kernel->find(native_pointer(ctx, args[0], "strlen"), 0, 0);
+}
+
+static long long native_strcmp(context *ctx, variable **args, int argc) {
+	if (argc != 2) err(ctx, "strcmp requires 2 arguments");
+	variable *s1 = native_pointer(ctx, args[0], "strcmp"), *s2 = native_pointer(ctx, args[1], "strcmp");
+	long long i = kernel->compare(s1, s2);
+	return s1[i].intval - s2[i].intval;
+}
+
+static long long native_strchr(context *ctx, variable **args, int argc) {
+	if (argc != 2) err(ctx, "strchr requires 2 arguments");
+	variable *s = native_pointer(ctx, args[0], "strchr");
+	long long i = kernel->find(s, args[1]->intval, 0);
+	return s[i].intval == args[1]->intval ? (long long) (s + i) : 0;
+}
+
+static long long native_memcmp(context *ctx, variable **args, int argc) {
+	if (argc != 3) err(ctx, "memcmp requires 3 arguments");
+	variable *x = native_pointer(ctx, args[0], "memcmp"), *y = native_pointer(ctx, args[1], "memcmp");
+	long long n = native_count(ctx, args[2], "memcmp"), i = kernel->diff(x, y, n);
+	return i == n ? 0 : x[i].intval - y[i].intval;
+}
+
+static long long native_memset(context *ctx, variable **args, int argc) {
+	if (argc != 3) err(ctx, "memset requires 3 arguments");
+	variable *d = native_pointer(ctx, args[0], "memset");
+	long long c = args[1]->intval, n = native_count(ctx, args[2], "memset"), i;
+	for (i = 0; i < n; i++) d[i].intval = c;
+	return (long long) d;
+}
+
+/* 要素をまるごと複写する (構造体の型情報も複写される) */
+static long long native_memcpy(context *ctx, variable **args, int argc) {
+	if (argc != 3) err(ctx, "memcpy requires 3 arguments");
+	variable *d = native_pointer(ctx, args[0], "memcpy"), *s = native_pointer(ctx, args[1], "memcpy");
+	memmove(d, s, native_count(ctx, args[2], "memcpy") * sizeof(variable));
+	return (long long) d;
+}
+
+static const struct {
+	const char *name;
+	native_func func;
+} natives[] = {
+	{"malloc", native_malloc}, {"calloc", native_calloc}, {"free", native_free},
+	{"strlen", native_strlen}, {"strcmp", native_strcmp}, {"strchr", native_strchr},
+	{"memcmp", native_memcmp}, {"memset", native_memset}, {"memcpy", native_memcpy},
+	{NULL, NULL}
+};
+
+/* token構造体の配列を実行します */
+static int proceed(context *ctx) {
+	int ef = 1, ret = RTYPE_NORMAL, i;
+	block builtin = {NULL, NULL}, blk = {&builtin, NULL};
+	for (i = 0; natives[i].name != NULL; i++) {
+		variable *var = ct_local(ctx, SITE_VAR, 1, sizeof(variable));
+		var->type = VT_NATIVE;
+		var->intval = (long long) natives[i].func;
+		builtin.table = map_add(ctx, builtin.table, (char *) natives[i].name, var);
+	}
+	ctx->global = &blk;
+	while (ctx->token->type != T_NULL) {
+		i = proceed_statement(ctx, &blk, ef);
+		if (ef) { ret = i; ef = !ret; }
+	}
+	return ctx->return_value;
+}
+
+static int skip_whitespace(FILE *fp, int *c) {
+	int newline = 0;
+	while (1) {
+		while (strchr("\r\n\t\v ", *c) != NULL) {
+			if (*c == '\n') newline = 1;
+			*c = fgetc(fp);
+		}
+		if (*c == '/') {
+			*c = fgetc(fp);
+			if (*c == '*') {
+				while(*c != EOF) {
+					*c = fgetc(fp);
+					if (*c == '*') {
+						*c = fgetc(fp);
+						if (*c == '/') {
+							*c = fgetc(fp);
+							break;
+						}
+					}
+				}
+			} else if (*c == '/') {
+				while (*c != '\n' && *c != EOF) *c = fgetc(fp);
+			} else {
+				ungetc(*c, fp);
+				newline = 0;
+				*c = '/';
+				break;
+			}
+		} else break;
+	}
+	return newline;
+}
+
+static int tokenize_ident(FILE *fp, int *c, char *s) {
+	if (('A' <= *c && *c <= 'Z') || ('a' <= *c && *c <= 'z') || *c == '_') {
+		do {
+			*s++ = (char) *c;
+			*c = fgetc(fp);
+		} while (('A' <= *c && *c <= 'Z') || ('a' <= *c && *c <= 'z') 
+				|| *c == '_' || ('0' <= *c && *c <= '9'));
+		*s = 0;
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static token *create_token_vector(context *ctx, FILE *fp, const char *fname);
+static int cache_covers(cantang_cache *cache, const char *path);
+static token *cache_load(context *ctx, const char *path);
+static void cache_put(cantang_cache *cache, struct cache_entry *e);
+
+/* path のトークン列を返します。ファイルがなければ NULL
+ * キャッシュはインクルードディレクトリの中のファイルだけに使う */
+static token *load_include(context *ctx, const char *path) {
+	token *tok;
+	FILE *fp;
+	if (ctx->cache != NULL && cache_covers(ctx->cache, path)) return cache_load(ctx, path);
+	if ((fp = fopen(path, "rb")) == NULL) return NULL;
+	tok = create_token_vector(ctx, fp, path);
+	fclose(fp);
+	return tok;
+}
+
+static token *process_file(context *ctx, char *s, int d, const char *fname) {
+	char str[1024];
+	token *tok;
+	if (d == '"') {
+		getbase_and_concat(fname, s, NULL, str);
+		if ((tok = load_include(ctx, str)) != NULL) return tok;
+	}
+	snprintf(str, sizeof(str), "%s/%s", ctx->include_dir, s);
+	if ((tok = load_include(ctx, str)) != NULL) return tok;
+	raise_error(ctx, CANTANG_ERR_IO, "Cannnot find %s", str);
+}
+
+static void ct_free_perm(context *ctx, void *p) {
+	memnode *n = (memnode *) p - 1;
+	mem_unlink(&ctx->mem, n);
+	mem_free(ctx, n);
+}
+
+/* トークン列の大きさを変えます。len 個のトークンが複写される */
+static token *resize_tokens(context *ctx, token *tok, int len, int size) {
+	token *ret = memcpy(ct_calloc(ctx, SITE_TOKEN, size, sizeof(token)), tok, len * sizeof(token));
+	ct_free_perm(ctx, tok);
+	return ret;
+}
+
+#define BRACE_MAX	256		// { と } の対応を記録する入れ子の深さ
+
+/* ソースファイルのfpを受け取り、token構造体の配列を返します */
+static token *create_token_vector(context *ctx, FILE *fp, const char *fname) {
+	int i = 0, size = 256, braces[BRACE_MAX], depth = 0;
+	token *tok = ct_calloc(ctx, SITE_TOKEN, size, sizeof(token));
+	int c = fgetc(fp);
+	int newline = 1;
+	while (1) {
+		char str[1024], *s = str;
+		if (skip_whitespace(fp, &c)) {
+			newline = 1;
+		}
+		if (c == EOF) break;
+		if (newline && c == '#') {
+			c = fgetc(fp);
+			newline = skip_whitespace(fp, &c);
+			tokenize_ident(fp, &c, str);
+			newline = skip_whitespace(fp, &c);
+			if (strcmp(str, "pragma") == 0 && !newline && tokenize_ident(fp, &c, str)
+					&& strcmp(str, "parallel") == 0) {
+				/* #pragma parallel の残りは通常のトークンとして扱う */
+				tok[i].type = T_KEYWORD;
+				tok[i].text = ct_strdup(ctx, str);
+				newline = 0;
+				if (++i >= size) tok = resize_tokens(ctx, tok, i, size *= 2);
+				continue;
+			}
+			if (strcmp(str, "include") == 0 && (c == '<' || c == '"')) {
+				int d = c == '<' ? '>' : '"';
+				while ((c = fgetc(fp)) != d) *s++ = c;
+				*s = 0;
+				c = fgetc(fp);
+				token *ts = process_file(ctx, str, d, fname);
+				int k;
+				for (k = 0; ts[k].type != T_NULL; k++) {
+					if (i + 1 >= size) tok = resize_tokens(ctx, tok, i, size *= 2);
+					tok[i++] = ts[k];
+				}
+				ct_free_perm(ctx, ts);
+				i--;
+			}
+			while (c != EOF && c != '\n') c = fgetc(fp);
+		} else if ('0' <= c && c <= '9') {
+			tok[i].type = T_INTVAL;
+			int val = 0;
+			do {
+				int digit = c - '0';
+				val = val * 10 + digit;
+				c = fgetc(fp);
+			} while ('0' <= c && c <= '9');
+			tok[i].intval = val;
+		} else if (c == '\'') {
+			long long d = 0;
+			while ((c = fgetc(fp)) != '\'') {
+				if (c == '\\') {
+					c = fgetc(fp);
+					if      (c == 'n') c = '\n';
+					else if (c == 't') c = '\t';
+				}
+				*s++ = c;
+				d = (d << 8) + c;
+			}
+			*s++ = 0;
+			tok[i].type = T_INTVAL;
+			tok[i].intval = (long long) d;
+			c = fgetc(fp);
+		} else if (c == '"') {
+			while ((c = fgetc(fp)) != '"') {
+				if (c == '\\') {
+					c = fgetc(fp);
+					if      (c == 'n') c = '\n';
+					else if (c == 't') c = '\t';
+				}
+				*s++ = c;
+			}
+			*s++ = '\0';
+			variable *var = ct_calloc(ctx, SITE_STRING, strlen(str) + 1, sizeof(variable));
+			tok[i].type = T_INTVAL;
+			tok[i].intval = (long long) var;
+			tok[i].string = 1;
+			for (s = str; ; s++, var++) {
+				var->type = VT_INT;
+				var->intval = (long long) *s;
+				if (!*s) break;
+			}
+			c = fgetc(fp);
+		} else {
+			int j = 0;
+			if (tokenize_ident(fp, &c, str)) {
+				for (; keywords[j] != NULL; j++) {
+					if (strcmp(keywords[j], str) == 0) break;
+				}
+				tok[i].type = keywords[j] == NULL ? T_IDENT : T_KEYWORD;
+			} else {
+				tok[i].type = T_SYMBOL;
+				while (c != EOF) {
+					*s++ = (char) c; *s = '\0';
+					for (j = 1; symbols[j].text != NULL; j++) {
+						if (strcmp(symbols[j].text, str) == 0) break;
+					}
+					if (symbols[j].text == NULL) {
+						*--s = '\0';
+						break;
+					}
+					tok[i].symbol = j;
+					c = fgetc(fp);
+				}
+				if (j == 0) err(ctx, "Bad char: %c", str[0]);
+				/* 対応はトークン数の差で記録するので、#include で複写しても変わらない */
+				if (strcmp(str, "{") == 0) {
+					if (depth < BRACE_MAX) braces[depth] = i;
+					depth++;
+				} else if (strcmp(str, "}") == 0 && depth > 0) {
+					if (--depth < BRACE_MAX) tok[braces[depth]].match = i - braces[depth];
+				}
+			}
+			tok[i].text = ct_strdup(ctx, str);
+		}
+		newline = 0;
+		if (++i >= size) tok = resize_tokens(ctx, tok, i, size *= 2);
+	}
+	tok[i].type = T_NULL;
+	return resize_tokens(ctx, tok, i + 1, i + 1);
+}
+
+cantang *cantang_create(const char *include_dir) {
+	cantang *ct = calloc(1, sizeof(cantang));
+	if (ct == NULL) return NULL;
+	ct->include_dir = strdup(include_dir != NULL ? include_dir : "include");
+	if (ct->include_dir == NULL) {
+		free(ct);
+		return NULL;
+	}
+	ct->heap = calloc(1, sizeof(memheap));
+	ct->budget = calloc(1, sizeof(budget));
+	ct->funcs = calloc(1, sizeof(funcstat));
+	if (ct->heap == NULL || ct->budget == NULL || ct->funcs == NULL) {
+		free(ct->heap);
+		free(ct->budget);
+		free(ct->funcs);
+		free(ct->include_dir);
+		free(ct);
+		return NULL;
+	}
+	pthread_mutex_init(&ct->heap->lock, NULL);
+	pthread_once(&kernel_once, select_kernel);
+	ct->out = stdout;
+	ct->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	return ct;
+}
+
+void cantang_destroy(cantang *ct) {
+	if (ct == NULL) return;
+	mem_release(ct, &ct->mem, NULL);
+	mem_release(ct, &ct->heap->list, NULL);
+	while (ct->held != NULL) {
+		cache_hold *h = ct->held;
+		ct->held = h->next;
+		cache_put(ct->cache, h->entry);
+		free(h);
+	}
+	pthread_mutex_destroy(&ct->heap->lock);
+	free(ct->heap->set);
+	free(ct->heap);
+	free(ct->budget);
+	free(ct->funcs);
+	if (ct->stats != NULL) {
+		pthread_mutex_destroy(&ct->stats->lock);
+		free(ct->stats);
+	}
+	free(ct->include_dir);
+	free(ct);
+}
+
+void cantang_set_output(cantang *ct, FILE *out) {
+	ct->out = out;
+}
+
+void cantang_set_threads(cantang *ct, int threads) {
+	ct->threads = threads;
+}
+
+int cantang_enable_mem_stats(cantang *ct, FILE *samples, double interval) {
+	int i;
+	if (ct->stats == NULL) {
+		if ((ct->stats = calloc(1, sizeof(memstat))) == NULL) return CANTANG_ERR_NOMEM;
+		pthread_mutex_init(&ct->stats->lock, NULL);
+	}
+	ct->stats->samples = samples;
+	ct->stats->interval = interval > 0 ? interval : 0.01;
+	ct->stats->start = now();
+	if (samples != NULL) {
+		fprintf(samples, "time,steps,live,peak");
+		for (i = 0; i < SITE_MAX; i++) fprintf(samples, ",%s", site_names[i]);
+		fputc('\n', samples);
+	}
+	return CANTANG_OK;
+}
+
+void cantang_mem_stats_report(cantang *ct, FILE *out) {
+	memstat *st = ct->stats;
+	long long count = 0, bytes = 0, live = 0;
+	int i;
+	if (st == NULL) return;
+	fprintf(out, "%-10s %12s %14s %12s\n", "site", "allocs", "bytes", "live");
+	for (i = 0; i < SITE_MAX; i++) {
+		fprintf(out, "%-10s %12lld %14lld %12lld\n", site_names[i], st->count[i], st->bytes[i], st->live[i]);
+		count += st->count[i];
+		bytes += st->bytes[i];
+		live += st->live[i];
+	}
+	fprintf(out, "%-10s %12lld %14lld %12lld\n", "total", count, bytes, live);
+	fprintf(out, "peak live bytes: %lld\n", st->peak);
+}
+
+void cantang_set_limits(cantang *ct, long long max_steps, long long max_mem, double timeout) {
+	ct->budget->max_steps = max_steps;
+	ct->budget->max_mem = max_mem;
+	ct->budget->timeout = timeout;
+}
+
+const char *cantang_error(cantang *ct) {
+	return ct->errmsg;
+}
+
+int cantang_load_fp(cantang *ct, FILE *fp, const char *fname) {
+	jmp_buf jmp;
+	int code;
+	if (ct->tokens != NULL) {
+		snprintf(ct->errmsg, sizeof(ct->errmsg), "Script already loaded");
+		return CANTANG_ERR_STATE;
+	}
+	ct->errmsg[0] = '\0';
+	ct->stage = CANTANG_ERR_LOAD;
+	ct->jmp = &jmp;
+	if ((code = setjmp(jmp)) != 0) return code;
+	ct->tokens = create_token_vector(ct, fp, fname);
+	return CANTANG_OK;
+}
+
+int cantang_load_file(cantang *ct, const char *fname) {
+	FILE *fp = fopen(fname, "rb");
+	int code;
+	if (fp == NULL) {
+		snprintf(ct->errmsg, sizeof(ct->errmsg), "File open error: %s", fname);
+		return CANTANG_ERR_IO;
+	}
+	code = cantang_load_fp(ct, fp, fname);
+	fclose(fp);
+	return code;
+}
+
+int cantang_run(cantang *ct, long long *retval) {
+	jmp_buf jmp;
+	token *t;
+	int code;
+	if (ct->tokens == NULL) {
+		snprintf(ct->errmsg, sizeof(ct->errmsg), "No script loaded");
+		return CANTANG_ERR_STATE;
+	}
+	ct->errmsg[0] = '\0';
+	ct->stage = CANTANG_ERR_RUNTIME;
+	ct->token = ct->tokens;
+	ct->return_value = 0;
+	ct->steps = ct->budget->steps = 0;
+	ct->funcs->declared = ct->funcs->materialized = 0;
+	for (t = ct->tokens; t->type != T_NULL; t++) t->materialized = 0;
+	ct->budget->deadline = ct->budget->timeout > 0 ? now() + ct->budget->timeout : 0;
+	stack_init(ct);
+	ct->jmp = &jmp;
+	code = setjmp(jmp);
+	if (code == 0) proceed(ct);
+	if (ct->stats != NULL && ct->stats->samples != NULL) {
+		__atomic_add_fetch(&ct->budget->steps, ct->steps, __ATOMIC_RELAXED);
+		ct->steps = 0;
+		mem_sample(ct, now());
+	}
+	/* グローバルスコープを含め、実行中に確保した領域を解放する */
+	mem_release(ct, &ct->temps, NULL);
+	mem_release(ct, &ct->locals, NULL);
+	if (code != 0) return code;
+	if (retval != NULL) *retval = ct->return_value;
+	return CANTANG_OK;
+}
+
+void cantang_func_stats_report(cantang *ct, FILE *out) {
+	long long declared = ct->funcs->declared, materialized = ct->funcs->materialized;
+	fprintf(out, "functions: %lld declared, %lld materialized, %lld never materialized\n",
+			declared, materialized, declared - materialized);
+}
+
+long long cantang_leak_report(cantang *ct, FILE *out) {
+	long long count = 0, bytes = 0;
+	memnode *n;
+	pthread_mutex_lock(&ct->heap->lock);
+	for (n = ct->heap->list; n != NULL; n = n->next) {
+		if (out != NULL) fprintf(out, "leak: %zu elements at %p\n", n->size / sizeof(variable), (void *) (n + 1));
+		count++;
+		bytes += n->size;
+	}
+	pthread_mutex_unlock(&ct->heap->lock);
+	if (out != NULL) fprintf(out, "leak check: %lld blocks (%lld bytes) not freed\n", count, bytes);
+	return count;
+}
+
+/* #include するファイルのトークン列のキャッシュ
+ * ファイルごとにインスタンスを作って読み込み、変更されていなければそのトークン列を複写して使う。
+ * 対象はインクルードディレクトリの中のファイルだけなので、エントリの数はその中のファイル数で抑えられる */
+typedef struct cache_entry {
+	struct cache_entry *next;
+	int refs;			// entries からの参照と複写中のスレッドの数。0 になったら解放する
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	cantang *ct;		// トークン列と文字列を持つインスタンス
+	int count;			// T_NULL を含むトークンの数
+	int *strings;		// 文字列リテラルのトークンの位置 (文字列はインスタンスごとに複写する)
+	int nstrings;
+} cache_entry;
+
+struct cantang_cache {
+	pthread_mutex_t lock;	// entries と refs
+	cache_entry *entries;	// パスごとに最新のものだけを持つ。公開したエントリは refs 以外変更しない
+	char *include_dir;
+};
+
+static int cmp_ptr(const void *a, const void *b) {
+	uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void cache_entry_free(cache_entry *e) {
+	if (e == NULL) return;
+	cantang_destroy(e->ct);
+	free(e->strings);
+	free(e->path);
+	free(e);
+}
+
+/* path を読み込んでエントリを作ります。失敗したら NULL を返し、errmsg に理由を格納する */
+static cache_entry *cache_entry_create(cantang_cache *cache, const char *path, struct stat *st, char *errmsg) {
+	cache_entry *e = calloc(1, sizeof(cache_entry));
+	uintptr_t *strs = NULL;
+	memnode *n;
+	int i, count = 0;
+	if (e == NULL || (e->path = strdup(path)) == NULL || (e->ct = cantang_create(cache->include_dir)) == NULL) {
+		snprintf(errmsg, 256, "Out of memory");
+		goto fail;
+	}
+	if (cantang_load_file(e->ct, path) != CANTANG_OK) {
+		snprintf(errmsg, 256, "%s", cantang_error(e->ct));
+		goto fail;
+	}
+	for (e->count = 1; e->ct->tokens[e->count - 1].type != T_NULL; e->count++);
+	/* 文字列リテラルは SITE_STRING で確保されているので、その先頭を指すトークンを探す */
+	for (n = e->ct->mem; n != NULL; n = n->next) if (n->site == SITE_STRING) count++;
+	if (count > 0) {
+		if ((strs = malloc(count * sizeof(uintptr_t))) == NULL
+				|| (e->strings = malloc(count * sizeof(int))) == NULL) {
+			snprintf(errmsg, 256, "Out of memory");
+			goto fail;
+		}
+		for (count = 0, n = e->ct->mem; n != NULL; n = n->next)
+			if (n->site == SITE_STRING) strs[count++] = (uintptr_t) (n + 1);
+		qsort(strs, count, sizeof(uintptr_t), cmp_ptr);
+		for (i = 0; i < e->count; i++) {
+			uintptr_t p = (uintptr_t) e->ct->tokens[i].intval;
+			if (e->ct->tokens[i].type == T_INTVAL && bsearch(&p, strs, count, sizeof(uintptr_t), cmp_ptr) != NULL)
+				e->strings[e->nstrings++] = i;
+		}
+		free(strs);
+	}
+	e->mtime = st->st_mtim;
+	e->size = st->st_size;
+	e->refs = 1;
+	return e;
+fail:
+	cache_entry_free(e);
+	free(strs);
+	return NULL;
+}
+
+/* 参照を 1 つ減らし、なくなったら解放します。cache->lock を持って呼ぶ */
+static void cache_entry_release(cache_entry *e) {
+	if (--e->refs == 0) cache_entry_free(e);
+}
+
+/* path がキャッシュの対象 (インクルードディレクトリの中) なら 1 を返します */
+static int cache_covers(cantang_cache *cache, const char *path) {
+	size_t len = strlen(cache->include_dir);
+	return strncmp(path, cache->include_dir, len) == 0 && path[len] == '/' && strstr(path + len, "/..") == NULL;
+}
+
+/* path のエントリの参照を 1 つ取って返します。なければ、または変更されていれば読み込み直す。
+ * ファイルがなければ NULL を返し、読み込みに失敗したら errmsg に理由を格納して NULL を返す。
+ * 使い終わったら cache_put で返す */
+static cache_entry *cache_get(cantang_cache *cache, const char *path, char *errmsg) {
+	struct stat st;
+	cache_entry *e, **p;
+	errmsg[0] = '\0';
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+	pthread_mutex_lock(&cache->lock);
+	for (p = &cache->entries; *p != NULL; p = &(*p)->next)
+		if (strcmp((*p)->path, path) == 0) break;
+	e = *p;
+	if (e == NULL || e->size != st.st_size || e->mtime.tv_sec != st.st_mtim.tv_sec
+			|| e->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+		/* 古いエントリは外し、複写中のスレッドがなくなったときに解放する */
+		if (e != NULL) {
+			*p = e->next;
+			cache_entry_release(e);
+		}
+		if ((e = cache_entry_create(cache, path, &st, errmsg)) != NULL) {
+			e->next = cache->entries;
+			cache->entries = e;
+		}
+	}
+	if (e != NULL) e->refs++;
+	pthread_mutex_unlock(&cache->lock);
+	return e;
+}
+
+static void cache_put(cantang_cache *cache, cache_entry *e) {
+	pthread_mutex_lock(&cache->lock);
+	cache_entry_release(e);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* キャッシュから path のトークン列を複写して返します。ファイルがなければ NULL */
+static token *cache_load(context *ctx, const char *path) {
+	char errmsg[256];
+	cache_entry *e = cache_get(ctx->cache, path, errmsg);
+	int i;
+	if (e == NULL) {
+		if (errmsg[0] != '\0') err(ctx, "%s", errmsg);
+		return NULL;
+	}
+	/* 複写したトークンの text はエントリのものを指すので、参照はインスタンスを破棄するときに返す */
+	cache_hold *h = malloc(sizeof(cache_hold));
+	if (h == NULL) {
+		cache_put(ctx->cache, e);
+		raise_error(ctx, CANTANG_ERR_NOMEM, "Out of memory");
+	}
+	h->entry = e;
+	h->next = ctx->held;
+	ctx->held = h;
+	token *tok = memcpy(ct_calloc(ctx, SITE_TOKEN, e->count, sizeof(token)), e->ct->tokens, e->count * sizeof(token));
+	for (i = 0; i < e->nstrings; i++) {
+		variable *s = (variable *) tok[e->strings[i]].intval;
+		size_t len = kernel->find(s, 0, 0) + 1;
+		tok[e->strings[i]].intval = (long long) memcpy(ct_calloc(ctx, SITE_STRING, len, sizeof(variable)),
+				s, len * sizeof(variable));
+	}
+	return tok;
+}
+
+cantang_cache *cantang_cache_create(const char *include_dir) {
+	char path[1024], errmsg[256];
+	struct dirent *d;
+	DIR *dir;
+	cache_entry *e;
+	cantang_cache *cache = calloc(1, sizeof(cantang_cache));
+	if (cache == NULL) return NULL;
+	if ((cache->include_dir = strdup(include_dir != NULL ? include_dir : "include")) == NULL) {
+		free(cache);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	/* include の *.h は先に読み込んでおく */
+	if ((dir = opendir(cache->include_dir)) != NULL) {
+		while ((d = readdir(dir)) != NULL) {
+			size_t len = strlen(d->d_name);
+			if (len < 2 || strcmp(d->d_name + len - 2, ".h") != 0) continue;
+			snprintf(path, sizeof(path), "%s/%s", cache->include_dir, d->d_name);
+			if ((e = cache_get(cache, path, errmsg)) != NULL) cache_put(cache, e);
+		}
+		closedir(dir);
+	}
+	return cache;
+}
+
+void cantang_cache_destroy(cantang_cache *cache) {
+	if (cache == NULL) return;
+	while (cache->entries != NULL) {
+		cache_entry *e = cache->entries;
+		cache->entries = e->next;
+		cache_entry_free(e);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->include_dir);
+	free(cache);
+}
+
+void cantang_set_cache(cantang *ct, cantang_cache *cache) {
+	ct->cache = cache;
+}
+
+/* スレッドプール */
+typedef struct pool_job {
+	struct pool_job *next;
+	char *fname;
+	cantang_callback cb;
+	void *arg;
+} pool_job;
+
+struct cantang_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;	// ジョブが投入された、または終了要求
+	pthread_cond_t idle;	// 未完了のジョブがなくなった
+	pool_job *head, *tail;
+	int pending;			// 未完了のジョブ数
+	int shutdown;
+	int nthreads;
+	pthread_t *threads;
+	char *include_dir;
+	int job_threads;				// 各ジョブの parallel for のワーカースレッド数
+	long long max_steps, max_mem;	// 各ジョブの実行の上限
+	double timeout;
+};
+
+static void run_job(cantang_pool *pool, pool_job *job) {
+	long long retval = 0;
+	int status = CANTANG_ERR_NOMEM;
+	const char *msg = "Out of memory";
+	cantang *ct = cantang_create(pool->include_dir);
+	if (ct != NULL) {
+		cantang_set_threads(ct, pool->job_threads);
+		cantang_set_limits(ct, pool->max_steps, pool->max_mem, pool->timeout);
+		status = cantang_load_file(ct, job->fname);
+		if (status == CANTANG_OK) status = cantang_run(ct, &retval);
+		msg = cantang_error(ct);
+	}
+	if (job->cb != NULL) job->cb(job->fname, status, retval, msg, job->arg);
+	cantang_destroy(ct);
+}
+
+static void *pool_worker(void *arg) {
+	cantang_pool *pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->head == NULL && !pool->shutdown)
+			pthread_cond_wait(&pool->ready, &pool->lock);
+		if (pool->head == NULL) break;
+		pool_job *job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL) pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+		run_job(pool, job);
+		free(job->fname);
+		free(job);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0) pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+cantang_pool *cantang_pool_create(int nthreads, const char *include_dir) {
+	cantang_pool *pool = calloc(1, sizeof(cantang_pool));
+	if (pool == NULL) return NULL;
+	if (nthreads < 1) nthreads = 1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->ready, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pool->include_dir = strdup(include_dir != NULL ? include_dir : "include");
+	pool->job_threads = 1;	// ジョブ自体が並行に動くので、既定では parallel for を並列にしない
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	if (pool->include_dir == NULL || pool->threads == NULL) {
+		cantang_pool_destroy(pool);
+		return NULL;
+	}
+	for (; pool->nthreads < nthreads; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL, pool_worker, pool) != 0) break;
+	}
+	if (pool->nthreads == 0) {
+		cantang_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void cantang_pool_set_threads(cantang_pool *pool, int threads) {
+	pool->job_threads = threads;
+}
+
+void cantang_pool_set_limits(cantang_pool *pool, long long max_steps, long long max_mem, double timeout) {
+	pool->max_steps = max_steps;
+	pool->max_mem = max_mem;
+	pool->timeout = timeout;
+}
+
+int cantang_pool_submit(cantang_pool *pool, const char *fname, cantang_callback cb, void *arg) {
+	pool_job *job = calloc(1, sizeof(pool_job));
+	if (job == NULL || (job->fname = strdup(fname)) == NULL) {
+		free(job);
+		return CANTANG_ERR_NOMEM;
+	}
+	job->cb = cb;
+	job->arg = arg;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail != NULL) pool->tail->next = job;
+	else pool->head = job;
+	pool->tail = job;
+	pool->pending++;
+	pthread_cond_signal(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+	return CANTANG_OK;
+}
+
+void cantang_pool_wait(cantang_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void cantang_pool_destroy(cantang_pool *pool) {
+	int i;
+	if (pool == NULL) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->ready);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->threads);
+	free(pool->include_dir);
+	free(pool);
+}
+
+// vim: ts=4 ai sw=4 :
@@ -0,0 +1,75 @@
+#ifndef CANTANG_H
+#define CANTANG_H
+
+#include <stdio.h>
+
+/* cantang_* 関数の戻り値 */
+enum {
+	CANTANG_OK = 0,
+	CANTANG_ERR_IO,			// ファイルが開けない
+	CANTANG_ERR_LOAD,		// トークン解析時のエラー
+	CANTANG_ERR_RUNTIME,	// 実行時のエラー
+	CANTANG_ERR_NOMEM,		// メモリ確保の失敗
+	CANTANG_ERR_STATE,		// API の呼び出し順序が不正
+	CANTANG_ERR_STEPS,		// 実行した文の数が上限を超えた
+	CANTANG_ERR_MEMLIMIT,	// 確保したメモリが上限を超えた
+	CANTANG_ERR_TIMEOUT,	// 実行時間が上限を超えた
+	CANTANG_ERR_DEPTH		// 関数呼び出しが深すぎてスタックが足りない
+};
+
+/* インタープリタのインスタンス。インスタンス間で状態は共有しない */
+typedef struct cantang cantang;
+
+/* include_dir は #include <...> の検索先 */
+cantang *cantang_create(const char *include_dir);
+void cantang_destroy(cantang *ct);
+/* print, puts の出力先 (既定は stdout) */
+void cantang_set_output(cantang *ct, FILE *out);
+/* parallel for のワーカースレッド数 (既定は CPU 数) */
+void cantang_set_threads(cantang *ct, int threads);
+/* 確保した場所ごとのメモリの集計を有効にします。cantang_load_* より前に呼んでください。
+ * samples が NULL でなければ、interval 秒ごとに CSV で記録します */
+int cantang_enable_mem_stats(cantang *ct, FILE *samples, double interval);
+void cantang_mem_stats_report(cantang *ct, FILE *out);
+/* 実行の上限 (文の数, バイト数, 秒)。0 は無制限。超えると実行を中断してエラーを返します */
+void cantang_set_limits(cantang *ct, long long max_steps, long long max_mem, double timeout);
+int cantang_load_file(cantang *ct, const char *fname);
+int cantang_load_fp(cantang *ct, FILE *fp, const char *fname);
+/* 読み込んだスクリプトを新しいグローバルスコープで実行し、return の値を retval に格納します */
+int cantang_run(cantang *ct, long long *retval);
+/* 直前のエラーの内容 */
+const char *cantang_error(cantang *ct);
+/* 直前の cantang_run で宣言された関数と、呼び出されて本体を読んだ関数の数を out に報告します */
+void cantang_func_stats_report(cantang *ct, FILE *out);
+/* スクリプトが malloc して free していない領域を out に報告し、その数を返します */
+long long cantang_leak_report(cantang *ct, FILE *out);
+
+/* #include するファイルのトークン列のキャッシュ。複数のインスタンスで共有できる。
+ * 作成時に include_dir の *.h を読み込み、ファイルが更新されていれば読み込み直します */
+typedef struct cantang_cache cantang_cache;
+
+cantang_cache *cantang_cache_create(const char *include_dir);
+/* キャッシュを使っているインスタンスをすべて破棄してから呼んでください */
+void cantang_cache_destroy(cantang_cache *cache);
+/* cantang_load_* より前に呼んでください */
+void cantang_set_cache(cantang *ct, cantang_cache *cache);
+
+/* 複数のスクリプトを並行に実行するスレッドプール */
+typedef struct cantang_pool cantang_pool;
+/* ジョブの終了時にワーカースレッドから呼ばれます */
+typedef void (*cantang_callback)(const char *fname, int status, long long retval,
+		const char *errmsg, void *arg);
+
+cantang_pool *cantang_pool_create(int nthreads, const char *include_dir);
+/* 各ジョブの parallel for のワーカースレッド数 (既定は 1) */
+void cantang_pool_set_threads(cantang_pool *pool, int threads);
+/* 各ジョブに cantang_set_limits と同じ上限を設定します */
+void cantang_pool_set_limits(cantang_pool *pool, long long max_steps, long long max_mem, double timeout);
+int cantang_pool_submit(cantang_pool *pool, const char *fname, cantang_callback cb, void *arg);
+/* 投入済みのジョブがすべて終わるまで待ちます */
+void cantang_pool_wait(cantang_pool *pool);
+void cantang_pool_destroy(cantang_pool *pool);
+
+#endif
+
+// vim: ts=4 ai sw=4 :
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE		// fopencookie
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "cantang.h"
+#include "server.h"
+
+/* プロトコル
+ * リクエスト (クライアント → サーバー)
+ *     file <パス>\n                     サーバーがそのファイルを読み込んで実行する
+ *     source <バイト数> <名前>\n <ソース>  送ったソースを実行する。名前は #include "..." の基準
+ * レスポンス (サーバー → クライアント)
+ *     out <バイト数>\n <データ>           print, puts の出力 (実行中に順次送る)
+ *     err <バイト数>\n <データ>           エラーメッセージ
+ *     exit <コード> <戻り値>\n             cantang_run のコードと return の値。これで終わり */
+
+typedef struct {
+	int fd;
+	const char *include_dir;
+	const serve_options *opt;
+	cantang_cache *cache;
+} server;
+
+static const char *socket_path;
+
+static void on_signal(int sig) {
+	(void) sig;
+	unlink(socket_path);
+	_exit(0);
+}
+
+static ssize_t out_write(void *cookie, const char *buf, size_t size) {
+	FILE *sock = cookie;
+	if (fprintf(sock, "out %zu\n", size) < 0 || fwrite(buf, 1, size, sock) != size || fflush(sock) != 0) return -1;
+	return size;
+}
+
+/* 1つのリクエストを新しいインスタンスで実行します */
+static void handle(server *sv, int fd) {
+	char line[PATH_MAX + 64], *src = NULL;
+	long long retval = 0;
+	int status;
+	size_t len;
+	FILE *in = fdopen(dup(fd), "r"), *sock = fdopen(dup(fd), "w"), *out = NULL, *fp = NULL;
+	cantang *ct = NULL;
+	cookie_io_functions_t io = {NULL, out_write, NULL, NULL};
+	if (in == NULL || sock == NULL || fgets(line, sizeof(line), in) == NULL) goto end;
+	line[strcspn(line, "\n")] = '\0';
+	if ((ct = cantang_create(sv->include_dir)) == NULL || (out = fopencookie(sock, "w", io)) == NULL) {
+		fprintf(sock, "err 13\nOut of memory\nexit %d 0\n", CANTANG_ERR_NOMEM);
+		goto end;
+	}
+	setvbuf(out, NULL, _IOLBF, 4096);
+	cantang_set_cache(ct, sv->cache);
+	cantang_set_output(ct, out);
+	if (sv->opt->threads > 0) cantang_set_threads(ct, sv->opt->threads);
+	cantang_set_limits(ct, sv->opt->max_steps, sv->opt->max_mem, sv->opt->timeout);
+	if (strncmp(line, "file ", 5) == 0) {
+		status = cantang_load_file(ct, line + 5);
+	} else {
+		int n = 0;
+		status = CANTANG_ERR_IO;
+		if (sscanf(line, "source %zu %n", &len, &n) == 1 && n > 0 && (src = malloc(len + 1)) != NULL
+				&& fread(src, 1, len, in) == len) {
+			src[len] = '\n';	// 空のソースでも fmemopen できるように
+			if ((fp = fmemopen(src, len + 1, "r")) != NULL) status = cantang_load_fp(ct, fp, line + n);
+		}
+	}
+	if (status == CANTANG_OK) status = cantang_run(ct, &retval);
+	fflush(out);
+	if (status != CANTANG_OK) {
+		const char *msg = cantang_error(ct)[0] != '\0' ? cantang_error(ct) : "Bad request";
+		fprintf(sock, "err %zu\n%s", strlen(msg), msg);
+	}
+	fprintf(sock, "exit %d %lld\n", status, retval);
+end:
+	if (fp != NULL) fclose(fp);
+	if (out != NULL) fclose(out);
+	cantang_destroy(ct);
+	free(src);
+	if (sock != NULL) fclose(sock);
+	if (in != NULL) fclose(in);
+}
+
+static void *serve_loop(void *arg) {
+	server *sv = arg;
+	while (1) {
+		int fd = accept(sv->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+		handle(sv, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int serve(const char *path, int nthreads, const char *include_dir, const serve_options *opt) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	char tmp[sizeof(addr.sun_path)];
+	struct stat st;
+	server sv = {-1, include_dir, opt, NULL};
+	int i;
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid()) >= (int) sizeof(tmp)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 1;
+	}
+	if (stat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "Not a socket: %s\n", path);
+		return 1;
+	}
+	/* ヘッダーを読み込んでから待ち受けを始める */
+	if ((sv.cache = cantang_cache_create(include_dir)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	/* 一時的な名前で待ち受けを始めてから置き換えるので、path が見えたら接続できる */
+	strcpy(addr.sun_path, tmp);
+	unlink(tmp);
+	if ((sv.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(sv.fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+			|| listen(sv.fd, 64) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		if (sv.fd >= 0) close(sv.fd);
+		cantang_cache_destroy(sv.cache);
+		return 1;
+	}
+	socket_path = path;
+	signal(SIGPIPE, SIG_IGN);	// クライアントが途中で切断しても続ける
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (nthreads < 1) nthreads = 1;
+	for (i = 1; i < nthreads; i++) {
+		pthread_t th;
+		if (pthread_create(&th, NULL, serve_loop, &sv) == 0) pthread_detach(th);
+	}
+	serve_loop(&sv);
+	unlink(path);
+	close(sv.fd);
+	return 1;
+}
+
+/* 送られてきた len バイトを to に書き写します */
+static int copy_frame(FILE *in, FILE *to, size_t len) {
+	char buf[4096];
+	while (len > 0) {
+		size_t n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), in);
+		if (n == 0) return -1;
+		if (to != NULL) fwrite(buf, 1, n, to);
+		len -= n;
+	}
+	return 0;
+}
+
+int client(const char *path, const char *fname, long long *retval) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	char line[PATH_MAX + 64], err[256] = "";
+	int fd, status = -1;
+	size_t len;
+	FILE *sock, *in;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return CANTANG_ERR_IO;
+	}
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return CANTANG_ERR_IO;
+	}
+	sock = fdopen(dup(fd), "w");
+	in = fdopen(fd, "r");
+	if (strcmp(fname, "-") == 0) {
+		/* 標準入力は送り、#include "..." はカレントディレクトリを基準にする */
+		char *src = NULL, cwd[PATH_MAX];
+		size_t cap = 0, n;
+		len = 0;
+		do {
+			if (len == cap && (src = realloc(src, cap = cap ? cap * 2 : 4096)) == NULL) break;
+			len += n = fread(src + len, 1, cap - len, stdin);
+		} while (n > 0);
+		if (src != NULL && getcwd(cwd, sizeof(cwd)) != NULL) {
+			fprintf(sock, "source %zu %s/-\n", len, cwd);
+			fwrite(src, 1, len, sock);
+		}
+		free(src);
+	} else {
+		char real[PATH_MAX];
+		if (realpath(fname, real) == NULL) {
+			fprintf(stderr, "File open error: %s\n", fname);
+			fclose(sock);
+			fclose(in);
+			return CANTANG_ERR_IO;
+		}
+		fprintf(sock, "file %s\n", real);
+	}
+	fflush(sock);
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (sscanf(line, "out %zu", &len) == 1) {
+			if (copy_frame(in, stdout, len) != 0) break;
+			fflush(stdout);
+		} else if (sscanf(line, "err %zu", &len) == 1) {
+			size_t n = len < sizeof(err) ? len : sizeof(err) - 1;
+			if (fread(err, 1, n, in) != n || copy_frame(in, NULL, len - n) != 0) break;
+			err[n] = '\0';
+		} else if (sscanf(line, "exit %d %lld", &status, retval) == 2) {
+			break;
+		}
+	}
+	fclose(sock);
+	fclose(in);
+	if (status < 0) {
+		fprintf(stderr, "Connection closed by %s\n", path);
+		return CANTANG_ERR_IO;
+	}
+	if (status != CANTANG_OK) fprintf(stderr, "%s\n", err);
+	return status;
+}
+
+// vim: ts=4 ai sw=4 :
@@ -0,0 +1,19 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* サーバーで各リクエストに設定する値 */
+typedef struct {
+	int threads;					// parallel for のワーカースレッド数 (0 は既定値)
+	long long max_steps, max_mem;	// 実行の上限
+	double timeout;
+} serve_options;
+
+/* path の Unix ドメインソケットでリクエストを待ち、nthreads 個のスレッドで実行します */
+int serve(const char *path, int nthreads, const char *include_dir, const serve_options *opt);
+/* path のサーバーで fname ("-" は標準入力) を実行し、出力を標準出力に、エラーを標準エラー出力に書きます。
+ * 戻り値は cantang_run と同じコードで、return の値を retval に格納する */
+int client(const char *path, const char *fname, long long *retval);
+
+#endif
+
+// vim: ts=4 ai sw=4 :
@@ -0,0 +1,21 @@
+int a[1000], i, j, sum = 0, m = 0, x = 5;
+parallel for (i = 0; i < 1000; i++) {
+	a[i] = i * 2;
+}
+#pragma parallel for reduction(+: sum)
+for (i = 0; i < 1000; i++) {
+	int t = a[i];
+	sum = sum + t;
+}
+parallel reduction(max: m) for (i = 999; i >= 0; i -= 3) {
+	if (a[i] > m) m = a[i];
+}
+j = i;
+parallel reduction(min: x) for (i = 1; i <= 10; i++) if (a[i] < x) x = a[i];
+// int であふれても逐次実行と同じ結果になる。比較も int なので、出力をスレッド数を変えて比べる (Makefile)
+int k, s = 0, p = 1;
+parallel reduction(+: s) for (k = 0; k < 10000; k++) s = s + 300000;
+parallel reduction(*: p) for (k = 0; k < 39; k++) p = p * 3;
+print s;
+print p;
+return (sum == 999000 && m == 1998 && j == -3 && i == 11 && x == 2) - 1;
@@ -0,0 +1,14 @@
+#include <string.h>
+#include <stdlib.h>
+int *p = malloc(10), i, s = 0;
+for (i = 0; i < 10; i++) p[i] = i;
+for (i = 0; i < 1000; i++) {
+	int a[100];		// ブロックを抜けるたびに解放される
+	a[99] = p[i % 10];
+	s = s + a[99];
+}
+char *t = strdup("abc");
+s = s + strlen(t);
+free(t);
+free(p);
+return s - 4503;
@@ -0,0 +1,46 @@
+#include <string.h>
+#include <stdlib.h>
+int r = 0, n, i;
+// 4 要素ずつの比較の境界をまたぐ長さを試す
+for (n = 0; n < 40; n++) {
+	char *s = calloc(n + 1, 1);
+	char *t = malloc(n + 1);
+	for (i = 0; i < n; i++) s[i] = 'a' + i % 26;
+	memcpy(t, s, n + 1);
+	if (strlen(s) != n) r = 1;
+	if (strcmp(s, t) != 0 || memcmp(s, t, n + 1) != 0) r = 2;
+	if (n > 0) {
+		t[n - 1] = 'z' + 1;
+		if (strcmp(s, t) >= 0 || strcmp(t, s) <= 0) r = 3;
+		char *p = strchr(s, s[n - 1]);
+		if (p == 0 || p[0] != s[n - 1] || strlen(p) != n - (n - 1) % 26) r = 4;
+		t[n - 1] = 0;
+		if (strcmp(s, t) <= 0 || strlen(t) != n - 1) r = 5;
+	}
+	char *e = strchr(s, 0);
+	if (strchr(s, '#') != 0 || e == 0 || e[0] != 0) r = 6;
+	memset(t, 'x', n);
+	for (i = 0; i < n; i++) if (t[i] != 'x') r = 7;
+	free(s);
+	free(t);
+}
+// strcmp は最初に異なる位置か終端で止まる
+for (n = 1; n < 40; n++) {
+	char *s = calloc(n + 1, 1);
+	char *t = calloc(n + 1, 1);
+	for (i = 0; i < n; i++) {
+		s[i] = 'a';
+		t[i] = 'a';
+	}
+	for (i = 0; i < n; i++) {
+		t[i] = 'b';
+		if (strcmp(s, t) != -1 || strcmp(t, s) != 1) r = 9;
+		t[i] = 'a';
+	}
+	t[n - 1] = 0;
+	if (strcmp(s, t) != 'a' || strcmp(t, s) != -'a') r = 10;
+	free(s);
+	free(t);
+}
+if (strcmp("abc", "abd") != -1 || strcmp("", "a") >= 0) r = 8;
+return r;
@@ -0,0 +1,47 @@
+// 密な case (分岐表) と fall through
+int dense(int op) {
+	int r = 0;
+	switch (op) {
+	case 0: r = 10; break;
+	case 1: r = 20;
+	case 2: r = r + 1; break;
+	case 3:
+	case 4: return 40;
+	default: r = -1;
+	}
+	return r;
+}
+
+// 疎な case (ハッシュ表)
+int sparse(int v) {
+	switch (v) {
+	case -100000: return 1;
+	case 7: return 2;
+	case 1000: return 3;
+	case 'a': return 4;
+	case 123456: return 5;
+	}
+	return 0;
+}
+
+int i;
+if (dense(0) != 10 || dense(1) != 21 || dense(2) != 1 || dense(3) != 40 || dense(4) != 40
+		|| dense(5) != -1 || dense(-1) != -1) return 1;
+if (sparse(-100000) != 1 || sparse(7) != 2 || sparse(1000) != 3 || sparse(97) != 4
+		|| sparse(123456) != 5 || sparse(8) != 0) return 2;
+
+// ループの中の continue, switch の中のループの break
+int c = 0;
+for (i = 0; i < 10; i++) {
+	switch (i % 3) {
+	case 0: continue;
+	case 1:
+		while (1) break;
+		c = c + 1;
+		break;
+	default:
+		switch (i) { case 5: c = c + 100; }
+	}
+	c = c + 10;
+}
+return c - 163;
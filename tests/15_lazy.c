@@ -0,0 +1,19 @@
+// 呼ばれない関数の本体は読まれない
+int unused1(int a) {
+	if (a) { while (a) { a--; } }
+	return a;
+}
+
+int twice(int a) {
+	int b[2];
+	b[0] = a;
+	{ b[1] = b[0] * 2; }
+	return b[1];
+}
+
+int unused2() {
+	return -1;
+}
+
+int r = twice(3) + twice(4);
+return r - 14;